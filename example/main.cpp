@@ -66,12 +66,18 @@ int main(int argc, char** argv) {
 
     QFileSystemModel fileSystemModel;
     fileSystemModel.sort(0);
-    /*QModelIndex rootIndex = */fileSystemModel.setRootPath(QDir::currentPath());
+    QModelIndex rootIndex = fileSystemModel.setRootPath(QDir::currentPath());
 
     TreeViewModel standardItemTreeViewModel;
     standardItemTreeViewModel.setSourceModel(&standardItemModel);
 
     TreeViewModel fileSystemTreeViewModel;
+    // a file system is a big tree, only expose the rows the user can actually see
+    fileSystemTreeViewModel.setVisibleRowsOnly(true);
+    // keep the expanded directories and the delegates when the file system model is reset
+    fileSystemTreeViewModel.setDiffOnReset(true);
+    // read the visible directories in advance, expanding them is then instant
+    fileSystemTreeViewModel.setPrefetchDepth(1);
 
     SortFilterProxyModel sortFilterProxyModel;
     sortFilterProxyModel.setDynamicSortFilter(true);
@@ -79,6 +85,8 @@ int main(int argc, char** argv) {
     sortFilterProxyModel.setSourceModel(&fileSystemModel);
 
     fileSystemTreeViewModel.setSourceModel(&sortFilterProxyModel);
+    // only the current directory gets items, the rest of the file system model is ignored
+    fileSystemTreeViewModel.setRootIndex(sortFilterProxyModel.mapFromSource(rootIndex));
 
     QTreeView tv;
     tv.setModel(&sortFilterProxyModel);
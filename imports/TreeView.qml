@@ -10,6 +10,14 @@ ScrollView {
 
     clip: true
 
+    // expands the ancestors of the item at the given path of key values and scrolls to it once they are loaded
+    function revealPath(path) {
+        control.model.revealPath(path, function(row) {
+            if (row >= 0)
+                listView.positionViewAtIndex(row, ListView.Contain)
+        })
+    }
+
     ListView {
         id: listView
 
@@ -18,5 +26,18 @@ ScrollView {
         model: control.model
 
         delegate: control.delegate
+
+        // the model fetches and prefetches the children of the visible items first (see TreeViewModel)
+        function reportVisibleRange() {
+            if (!control.model || control.model.setVisibleRange === undefined || count === 0)
+                return
+            var firstRow = indexAt(contentX, contentY)
+            var lastRow = indexAt(contentX, contentY + height - 1)
+            control.model.setVisibleRange(firstRow === -1 ? 0 : firstRow, lastRow === -1 ? count - 1 : lastRow)
+        }
+
+        onContentYChanged: reportVisibleRange()
+        onHeightChanged: reportVisibleRange()
+        onCountChanged: reportVisibleRange()
     }
-}
\ No newline at end of file
+}
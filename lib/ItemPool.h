@@ -0,0 +1,108 @@
+#pragma once
+
+#include <QtCore/QList>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+/**
+ * @brief The class ItemPool is a slab allocator for the items of a TreeViewModel.
+ *
+ * Items are constructed in the slots of large slabs instead of being allocated one by one on the heap. The slab size
+ * doubles with each new slab (up to maxSlabSize) so that small trees do not pay for a big slab. A destroyed item gives
+ * its slot back to a free list that is used before new slots are taken from the slabs, and clear() releases all the
+ * slabs at once.
+ */
+template <typename T>
+class ItemPool
+{
+public:
+    explicit ItemPool(int maxSlabSize = 4096): maxSlabSize_(maxSlabSize)
+    {
+    }
+
+    ~ItemPool()
+    {
+        clear();
+    }
+
+    ItemPool(const ItemPool&) = delete;
+    ItemPool& operator=(const ItemPool&) = delete;
+
+    template <typename... Args>
+    T* create(Args&&... args)
+    {
+        return new (allocate()) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Destroys the item and gives its slot back to the pool.
+     */
+    void destroy(T* item)
+    {
+        item->~T();
+        Slot* slot = reinterpret_cast<Slot*>(item);
+        slot->next = freeList_;
+        freeList_ = slot;
+        --size_;
+    }
+
+    /**
+     * Releases all the slabs at once. The items still alive must have been destroyed by the caller.
+     */
+    void clear()
+    {
+        for (Slot* slab: slabs_)
+            delete[] slab;
+        slabs_.clear();
+        freeList_ = nullptr;
+        usedSlots_ = 0;
+        size_ = 0;
+    }
+
+    /**
+     * Returns the number of items alive.
+     */
+    int size() const
+    {
+        return size_;
+    }
+
+    /**
+     * Returns the number of slabs allocated, that is to say the number of heap allocations made by the pool.
+     */
+    int slabCount() const
+    {
+        return slabs_.count();
+    }
+
+private:
+    union Slot {
+        Slot* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    void* allocate()
+    {
+        ++size_;
+        if (freeList_ != nullptr) {
+            Slot* slot = freeList_;
+            freeList_ = slot->next;
+            return slot;
+        }
+        if (slabs_.isEmpty() || usedSlots_ == slabSize_) {
+            slabSize_ = qMin(slabs_.isEmpty() ? 64 : slabSize_ * 2, maxSlabSize_);
+            slabs_.append(new Slot[slabSize_]);
+            usedSlots_ = 0;
+        }
+        return &slabs_.last()[usedSlots_++];
+    }
+
+    int maxSlabSize_;
+    int slabSize_ = 0;
+    int usedSlots_ = 0;
+    int size_ = 0;
+    Slot* freeList_ = nullptr;
+    QList<Slot*> slabs_;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <QtCore/QAbstractItemModel>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QPersistentModelIndex>
+#include <QtCore/QSet>
+
+
+/**
+ * @brief Set of persistent model indexes that can be looked up while the rows of their model change.
+ *
+ * The hash of a QPersistentModelIndex is computed from its current row: a QSet stores the hash of an index when it is
+ * inserted, so it no longer finds the index once rows have been inserted, removed or moved before it. The set watches
+ * the models that may shift its indexes (see setModels) and, on the first lookup after one of them changed, rehashes
+ * the indexes and drops the ones whose rows have been removed.
+ */
+class PersistentIndexSet
+{
+public:
+    PersistentIndexSet() = default;
+    PersistentIndexSet(const PersistentIndexSet&) = delete;
+    PersistentIndexSet& operator=(const PersistentIndexSet&) = delete;
+
+    ~PersistentIndexSet()
+    {
+        setModels(QList<const QAbstractItemModel*>());
+    }
+
+    /**
+     * Sets the models whose changes shift the indexes of the set: the model of the indexes and the models it is a proxy
+     * of, if any.
+     *
+     * The set must be connected to a model before the slots that look it up, so that a change is seen before they run:
+     * the connections to the models that remain watched are kept.
+     */
+    void setModels(const QList<const QAbstractItemModel*>& models)
+    {
+        for (const QAbstractItemModel* model: connections_.keys()) {
+            if (models.contains(model))
+                continue;
+            for (const QMetaObject::Connection& connection: connections_.take(model))
+                QObject::disconnect(connection);
+        }
+        for (const QAbstractItemModel* model: models) {
+            if (connections_.contains(model))
+                continue;
+            auto invalidate = [this] { dirty_ = true; };
+            QList<QMetaObject::Connection>& connections = connections_[model];
+            connections.append(QObject::connect(model, &QAbstractItemModel::rowsInserted, invalidate));
+            connections.append(QObject::connect(model, &QAbstractItemModel::rowsRemoved, invalidate));
+            connections.append(QObject::connect(model, &QAbstractItemModel::rowsMoved, invalidate));
+            connections.append(QObject::connect(model, &QAbstractItemModel::layoutChanged, invalidate));
+            connections.append(QObject::connect(model, &QAbstractItemModel::modelReset, invalidate));
+        }
+        dirty_ = true;
+    }
+
+    void insert(const QPersistentModelIndex& index)
+    {
+        rehash();
+        indexes_.insert(index);
+    }
+
+    void remove(const QPersistentModelIndex& index)
+    {
+        rehash();
+        indexes_.remove(index);
+    }
+
+    bool contains(const QPersistentModelIndex& index) const
+    {
+        rehash();
+        return indexes_.contains(index);
+    }
+
+    bool isEmpty() const
+    {
+        rehash();
+        return indexes_.isEmpty();
+    }
+
+    int count() const
+    {
+        rehash();
+        return indexes_.count();
+    }
+
+    void clear()
+    {
+        indexes_.clear();
+        dirty_ = false;
+    }
+
+    /**
+     * Returns the indexes of the set, which are all valid.
+     */
+    QList<QPersistentModelIndex> values() const
+    {
+        rehash();
+        return indexes_.toList();
+    }
+
+private:
+    void rehash() const
+    {
+        if (!dirty_)
+            return;
+        // iterating does not depend on the stored hashes, inserting into a new set hashes the current rows
+        QSet<QPersistentModelIndex> indexes;
+        indexes.reserve(indexes_.count());
+        for (const QPersistentModelIndex& index: indexes_) {
+            if (index.isValid())
+                indexes.insert(index);
+        }
+        indexes_.swap(indexes);
+        dirty_ = false;
+    }
+
+    mutable QSet<QPersistentModelIndex> indexes_;
+    // whether a watched model changed since the indexes were hashed
+    mutable bool dirty_ = false;
+    QHash<const QAbstractItemModel*, QList<QMetaObject::Connection>> connections_;
+};
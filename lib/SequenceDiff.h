@@ -0,0 +1,84 @@
+#pragma once
+
+#include <QtCore/QList>
+#include <QtCore/QPair>
+#include <algorithm>
+#include <vector>
+
+
+/**
+ * Computes a longest common subsequence of a and b with the Myers diff algorithm.
+ *
+ * The matched elements are appended to matches as (index in a, index in b) pairs, in increasing order. The cost is
+ * O((N + M) * D) in time and O(D^2) in memory, D being the number of elements that are not matched (the length of the
+ * edit script), so the search is abandoned as soon as D exceeds maxDifferences.
+ *
+ * @return false if the sequences have more than maxDifferences differences, in that case matches is left unchanged.
+ */
+template <typename T>
+bool longestCommonSubsequence(const QList<T>& a, const QList<T>& b, int maxDifferences,
+                              QList<QPair<int, int>>& matches)
+{
+    const int n = a.count();
+    const int m = b.count();
+    const int max = std::min(n + m, maxDifferences);
+    const int offset = max + 1;
+
+    // v[offset + k] is the furthest x reached on diagonal k = x - y, trace[d] holds v for k in [-d, d] after step d
+    std::vector<int> v(2 * max + 3, 0);
+    std::vector<std::vector<int>> trace;
+    int differences = -1;
+
+    for (int d = 0; d <= max && differences == -1; ++d) {
+        for (int k = -d; k <= d; k += 2) {
+            int x;
+            if (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1]))
+                x = v[offset + k + 1];
+            else
+                x = v[offset + k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[x] == b[y]) {
+                ++x;
+                ++y;
+            }
+            v[offset + k] = x;
+            if (x >= n && y >= m) {
+                differences = d;
+                break;
+            }
+        }
+        trace.emplace_back(v.begin() + offset - d, v.begin() + offset + d + 1);
+    }
+    if (differences == -1)
+        return false;
+
+    // walk the edit graph back from (n, m), collecting the diagonals (matched elements)
+    QList<QPair<int, int>> reversedMatches;
+    int x = n;
+    int y = m;
+    for (int d = differences; d > 0; --d) {
+        const std::vector<int>& previous = trace[d - 1];
+        auto previousX = [&](int k) { return previous[k + d - 1]; };
+        int k = x - y;
+        bool down = k == -d || (k != d && previousX(k - 1) < previousX(k + 1));
+        int previousK = down ? k + 1 : k - 1;
+        int startX = down ? previousX(previousK) : previousX(previousK) + 1;
+        int startY = startX - k;
+        while (x > startX && y > startY) {
+            --x;
+            --y;
+            reversedMatches.append(qMakePair(x, y));
+        }
+        x = previousX(previousK);
+        y = x - previousK;
+    }
+    while (x > 0 && y > 0) {
+        --x;
+        --y;
+        reversedMatches.append(qMakePair(x, y));
+    }
+
+    for (int i = reversedMatches.count() - 1; i >= 0; --i)
+        matches.append(reversedMatches[i]);
+    return true;
+}
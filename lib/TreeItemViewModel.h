@@ -1,65 +1,118 @@
 #pragma once
 
 #include <QtCore/QAbstractProxyModel>
+#include <QtCore/QHash>
 #include <QtCore/QList>
 #include <QtCore/QModelIndex>
-#include <QDebug>
+#include <QtCore/QPersistentModelIndex>
+#include <algorithm>
+#include "ItemPool.h"
+#include "PersistentIndexSet.h"
 
 
+class TreeItemViewModel;
+
+/**
+ * @brief The struct TreeItemViewModelContext holds the state that is shared by all the items of a TreeViewModel.
+ *
+ * Every item keeps a single pointer to the context of its model instead of its own copy of these references.
+ */
+struct TreeItemViewModelContext
+{
+    // Whether the flattened tree only contains the visible items (see TreeViewModel::setVisibleRowsOnly)
+    const bool& visibleRowsOnly;
+    // Source index to item lookup table, the items register themselves into it
+    QHash<QModelIndex, TreeItemViewModel*>& itemsByIndex;
+    // Pool in which the items are allocated
+    ItemPool<TreeItemViewModel>& itemPool;
+    // The proxy model that contains the items
+    QAbstractProxyModel* proxyModel;
+    // The proxy models between the proxy model and the model at the bottom of the chain, in mapping order
+    const QList<QAbstractProxyModel*>& proxyChain;
+    // Indexes of the expanded items in the model at the bottom of the proxy chain (see sourceIndexAcrossProxyChain)
+    PersistentIndexSet& expandedIndexes;
+};
+
 /**
  * @brief The class TreeItemViewModel is an internal representation of a tree item for use by the TreeViewModel.
  *
- * It contains the logic for adding and removing child nodes and updating the flat list representation of the tree
- * and holds the TreeItemView specific roles such as isExpanded, isHidden,...
+ * It contains the logic for adding and removing child nodes and keeping track of the row of each item in the flattened
+ * tree (see row), which the TreeViewModel updates, and holds the TreeItemView specific roles such as isExpanded,
+ * isHidden,...
+ *
+ * There is one item per source item so the layout is kept compact: the state shared by all the items lives in the
+ * context and the flags are packed into bit fields.
  */
 class TreeItemViewModel
 {
 public:
     /**
-     * Creates a root item.
+     * Creates the invisible root item.
+     *
+     * The root item is not part of the flattened tree: its row is -1 and its direct children are the top level items.
+     * It is not registered in the lookup table, its source index may change with the rows that are outside the tree.
      *
-     * @param sourceIndex sourceIndex of the model
-     * @param flattenedTree Flat representation of the tree
-     * @param proxyModel The proxy model that contains the items.
+     * @param context State shared by all the items of the model, it must outlive the items.
+     * @param sourceIndex Source index whose children are the top level items (see TreeViewModel::setRootIndex).
      */
-    TreeItemViewModel(QModelIndex sourceIndex, QList<TreeItemViewModel*>& flattenedTree,
-                      QMap<QModelIndex, bool>& expandedMap, QMap<QModelIndex, bool>& hiddenMap):
-        TreeItemViewModel(nullptr, sourceIndex, flattenedTree, proxyModel_, expandedMap, hiddenMap)
+    explicit TreeItemViewModel(TreeItemViewModelContext* context, const QModelIndex& sourceIndex = QModelIndex()):
+            sourceIndex_(sourceIndex),
+            subtreeSize_(1),
+            rowOffset_(0),
+            indent_(-1),
+            // the root item is always expanded so that the top level items are visible
+            isExpanded_(true),
+            isHidden_(false),
+            childOffsetsDirty_(false),
+            childrenMaterialized_(false),
+            isAttached_(true),
+            hasChildrenCached_(false),
+            hasChildren_(false),
+            parent_(nullptr),
+            context_(context)
     {
     }
 
-    TreeItemViewModel(TreeItemViewModel* parent, QModelIndex sourceIndex, QList<TreeItemViewModel*>& flattenedTree, QAbstractProxyModel* model,
-                      QMap<QModelIndex, bool>& expandedMap, QMap<QModelIndex, bool>& hiddenMap):
-            parent_(parent),
-            proxyModel_(model),
+    TreeItemViewModel(TreeItemViewModel* parent, QModelIndex sourceIndex):
             sourceIndex_(sourceIndex),
-            flattenedTree_(flattenedTree),
+            subtreeSize_(1),
+            rowOffset_(0),
+            indent_(parent->indent() + 1),
             isExpanded_(false),
-            expandedMap_(expandedMap),
-            hiddenMap_(hiddenMap)
+            isHidden_(parent->isCollapsed() || parent->isHidden()),
+            childOffsetsDirty_(false),
+            childrenMaterialized_(false),
+            isAttached_(true),
+            hasChildrenCached_(false),
+            hasChildren_(false),
+            parent_(parent),
+            context_(parent->context_)
     {
-        if (parent) {
-            isHidden_ = parent->isCollapsed() || parent->isHidden();;
-            indent_ = parent->indent() + 1;
-        }
-        else {
-            isHidden_ = false;
-            indent_ = 0;
-            flattenedTree.append(this);
-        }
+        context_->itemsByIndex.insert(sourceIndex, this);
+        if (!context_->expandedIndexes.isEmpty())
+            isExpanded_ = context_->expandedIndexes.contains(sourceIndexAcrossProxyChain(sourceIndex));
+    }
 
-        isExpanded_ = expandedMap.value(sourceIndexAcrossProxyChain(sourceIndex), isExpanded_);
+    /**
+     * Destroys the child items, recursively, giving their slot back to the item pool.
+     */
+    void destroyChildren()
+    {
+        for (TreeItemViewModel* child: childItems_) {
+            child->destroyChildren();
+            context_->itemPool.destroy(child);
+        }
+        childItems_.clear();
     }
 
+    /**
+     * Maps an index of the source model to the model at the bottom of the proxy chain, through the proxy chain
+     * resolved by the TreeViewModel.
+     */
     QPersistentModelIndex sourceIndexAcrossProxyChain(const QModelIndex& proxyIndex) const {
-        QAbstractProxyModel* proxyModel = proxyModel_;
-        QAbstractProxyModel* nextSubProxyModel = qobject_cast<QAbstractProxyModel*>(proxyModel->sourceModel());
         QModelIndex sourceIndex = proxyIndex;
-        while (nextSubProxyModel != nullptr) {
-            proxyModel = nextSubProxyModel;
+        for (QAbstractProxyModel* proxyModel: context_->proxyChain)
             sourceIndex = proxyModel->mapToSource(sourceIndex);
-            nextSubProxyModel = qobject_cast<QAbstractProxyModel*>(proxyModel->sourceModel());
-        }
         return QPersistentModelIndex(sourceIndex);
     }
 
@@ -80,62 +133,295 @@ public:
         return sourceIndex_;
     }
 
+    /**
+     * Creates the item of a new last child.
+     *
+     * The item is not added to the flattened tree, the caller is responsible for it (see TreeViewModel::flatten).
+     */
     TreeItemViewModel* addChild(QModelIndex index)
     {
-        TreeItemViewModel* child = new TreeItemViewModel(
-                this, index, flattenedTree_, proxyModel_, expandedMap_, hiddenMap_);
+        TreeItemViewModel* child = context_->itemPool.create(this, index);
 
-        int insertPoint = getLastChildRow() + 1;
-        flattenedTree_.insert(insertPoint, child);
+        // an appended child does not shift its siblings, its offset follows the one of the previous last child
+        if (!childOffsetsDirty_) {
+            if (childItems_.isEmpty())
+                child->rowOffset_ = 1;
+            else
+                child->rowOffset_ = childItems_.last()->rowOffset_ + childItems_.last()->subtreeSize_;
+        }
         childItems_.append(child);
+        onChildInserted(child);
+
+        return child;
+    }
 
+    /**
+     * Creates the item of a new child without attaching it to this item.
+     *
+     * The subtree of a detached item can be built (see addChild) without changing the rows of the items of the tree, it
+     * is attached afterwards with insertChildren.
+     */
+    TreeItemViewModel* createChild(QModelIndex index)
+    {
+        TreeItemViewModel* child = context_->itemPool.create(this, index);
+        child->isAttached_ = false;
         return child;
     }
 
-    TreeItemViewModel* insertChild(int row, QModelIndex index)
+    /**
+     * Attaches the children created with createChild at the given child position.
+     *
+     * The caller is responsible for inserting their rows into the flattened tree, at insertionRow(position).
+     */
+    void insertChildren(int position, const QList<TreeItemViewModel*>& children)
     {
-        if (childItems_.count() > row) {
-            TreeItemViewModel* child = new TreeItemViewModel(
-                    this, index, flattenedTree_, proxyModel_, expandedMap_, hiddenMap_);
-            int insertPoint = childItems_[row]->getLastChildRow();
-            flattenedTree_.insert(insertPoint, child);
-            childItems_.insert(row, child);
-            return child;
+        int rows = 0;
+        for (TreeItemViewModel* child: children) {
+            child->isAttached_ = true;
+            rows += child->subtreeSize_;
         }
-        else
-            addChild(index);
+        for (int i = 0; i < children.count(); ++i)
+            childItems_.insert(position + i, children[i]);
+        childOffsetsDirty_ = true;
+        if (childrenAreRows())
+            resizeSubtree(rows);
     }
 
-    void setExpanded(bool expanded)
+    /**
+     * Destroys the given number of children, starting at the given child position, and their descendants.
+     *
+     * The caller is responsible for removing their rows from the flattened tree and their entries from the lookup table
+     * (see unregisterSubtree).
+     */
+    void removeChildren(int position, int count)
     {
-        isExpanded_ = expanded;
-        expandedMap_[sourceIndexAcrossProxyChain(sourceIndex_)] = expanded;
+        int rows = 0;
+        for (int i = position; i < position + count; ++i) {
+            TreeItemViewModel* child = childItems_[i];
+            rows += child->subtreeSize_;
+            child->destroyChildren();
+            context_->itemPool.destroy(child);
+        }
+        childItems_.erase(childItems_.begin() + position, childItems_.begin() + position + count);
+        childOffsetsDirty_ = true;
+        if (childrenAreRows())
+            resizeSubtree(-rows);
+    }
+
+    /**
+     * Detaches the given number of children, starting at the given child position, without destroying them.
+     *
+     * They can be attached to another item with insertChildren, after reparent. The caller is responsible for moving
+     * their rows in the flattened tree.
+     */
+    QList<TreeItemViewModel*> takeChildren(int position, int count)
+    {
+        QList<TreeItemViewModel*> children = childItems_.mid(position, count);
+        int rows = 0;
+        for (TreeItemViewModel* child: children) {
+            child->isAttached_ = false;
+            rows += child->subtreeSize_;
+        }
+        childItems_.erase(childItems_.begin() + position, childItems_.begin() + position + count);
+        childOffsetsDirty_ = true;
+        if (childrenAreRows())
+            resizeSubtree(-rows);
+        return children;
+    }
+
+    /**
+     * Changes the parent of a detached item and updates the indentation and the hidden state of its subtree.
+     *
+     * No signal is emitted, the caller is responsible for notifying the change of the rows.
+     */
+    void reparent(TreeItemViewModel* parent)
+    {
+        parent_ = parent;
+        updateIndentAndHiddenState();
+    }
+
+    /**
+     * Turns a detached item into the root item, its children becoming the top level items.
+     *
+     * The item is expanded, like the root item, and the indentation and the hidden state of its descendants are
+     * updated. The caller is responsible for removing its entry from the lookup table.
+     */
+    void makeRoot()
+    {
+        parent_ = nullptr;
+        indent_ = -1;
+        isAttached_ = true;
+        isHidden_ = false;
+        if (!isExpanded_)
+            setExpanded(true);
+        for (TreeItemViewModel* child: childItems_)
+            child->updateIndentAndHiddenState();
+    }
+
+    /**
+     * Removes the entries of the item and of its descendants from the lookup table.
+     *
+     * This must be done while their source indexes are still valid, i.e. before the source rows are removed or moved.
+     */
+    void unregisterSubtree()
+    {
+        context_->itemsByIndex.remove(sourceIndex_);
+        for (TreeItemViewModel* child: childItems_)
+            child->unregisterSubtree();
+    }
+
+    /**
+     * Adds the entries of the item and of its descendants to the lookup table, under their current source index.
+     */
+    void registerSubtree()
+    {
+        context_->itemsByIndex.insert(sourceIndex_, this);
+        for (TreeItemViewModel* child: childItems_)
+            child->registerSubtree();
+    }
+
+    int childCount() const
+    {
+        return childItems_.count();
+    }
+
+    TreeItemViewModel* child(int position) const
+    {
+        return childItems_[position];
+    }
+
+    /**
+     * Returns true if the children of the item are part of the flattened tree.
+     */
+    bool childrenAreInFlattenedTree() const
+    {
+        return !context_->visibleRowsOnly || (isExpanded_ && !isHidden_);
+    }
 
-        QModelIndex proxyIndex = proxyModel_->mapFromSource(sourceIndex());
-        emit proxyModel_->dataChanged(proxyIndex, proxyIndex);
+    /**
+     * Returns the row of the flattened tree at which the rows of children inserted at the given child position start.
+     */
+    int insertionRow(int position)
+    {
+        if (position < childItems_.count())
+            return childItems_[position]->row();
+        return getLastChildRow() + 1;
+    }
 
-        if (proxyModel_->sourceModel()->canFetchMore(sourceIndex()))
-            proxyModel_->sourceModel()->fetchMore(sourceIndex());
+    /**
+     * Updates the expanded state of the item and the hidden state of its descendants.
+     *
+     * In visible rows only mode, the caller is responsible for inserting/removing the rows of the descendants into/from
+     * the flattened tree (see TreeViewModel::toggleIsExpanded), only the subtree sizes are updated here. Otherwise, the
+     * caller notifies the change of the hidden state of the descendants (see setHidden).
+     */
+    void setExpanded(bool expanded)
+    {
+        if (expanded != isExpanded_ && context_->visibleRowsOnly) {
+            int childRows = 0;
+            for (TreeItemViewModel* child: childItems_)
+                childRows += child->subtreeSize_;
+            isExpanded_ = expanded;
+            resizeSubtree(expanded ? childRows : -childRows);
+        }
+        isExpanded_ = expanded;
+        if (expanded)
+            context_->expandedIndexes.insert(sourceIndexAcrossProxyChain(sourceIndex_));
+        else
+            context_->expandedIndexes.remove(sourceIndexAcrossProxyChain(sourceIndex_));
 
         for(TreeItemViewModel* child: childItems_)
-            child->setHidden(!isExpanded_);
+            child->setHidden(isHidden_ || !isExpanded_);
+    }
+
+    /**
+     * Sets the expanded state of the item and of its descendants in a single traversal.
+     *
+     * The items of the given number of levels (counting the item) that have children are expanded, the deeper ones are
+     * collapsed, every level is expanded if levels is negative. Only the items that have been created are affected.
+     * The hidden state and the subtree sizes are recomputed on the way back up: unlike calling setExpanded on each
+     * item, this does not walk the ancestors for every item. No signal is emitted, the caller is responsible for
+     * notifying the change of the rows.
+     */
+    void setSubtreeExpanded(int levels)
+    {
+        resizeSubtree(applySubtreeExpanded(levels) - subtreeSize_);
     }
 
+    /**
+     * Updates the hidden state of the item and of its descendants.
+     *
+     * No signal is emitted: the rows of the descendants of an item are contiguous, the caller notifies the change for
+     * the whole range at once (see TreeViewModel::toggleIsExpanded).
+     */
     void setHidden(bool hidden)
     {
-        isHidden_ = hidden;
-        hiddenMap_[sourceIndex_] = hidden;
+        // the state of the descendants only depends on the state of their ancestors
+        if (hidden == isHidden())
+            return;
 
-        QModelIndex proxyIndex = proxyModel_->mapFromSource(sourceIndex());
-        emit proxyModel_->dataChanged(proxyIndex, proxyIndex);
+        isHidden_ = hidden;
 
         for(TreeItemViewModel* child: childItems_)
             child->setHidden(isHidden_ || !isExpanded_);
     }
 
+    /**
+     * Appends the descendants that are rows when this item is expanded, in flattened tree order.
+     *
+     * In visible rows only mode, these are the descendants revealed by the expansion of the item.
+     */
+    void appendDescendantRows(QList<TreeItemViewModel*>& items) const
+    {
+        for (TreeItemViewModel* child: childItems_) {
+            items.append(child);
+            if (child->childrenAreRows())
+                child->appendDescendantRows(items);
+        }
+    }
+
+    /**
+     * Restores the order of the children after the layout of the source model has changed (e.g. after a sort).
+     *
+     * The children are sorted by the row of their (persistent) source index, the caller is responsible for updating the
+     * flattened tree.
+     */
+    void sortChildrenBySourceRow()
+    {
+        std::sort(childItems_.begin(), childItems_.end(), [](const TreeItemViewModel* a, const TreeItemViewModel* b) {
+            return a->sourceIndex_.row() < b->sourceIndex_.row();
+        });
+        childOffsetsDirty_ = true;
+    }
+
+    /**
+     * Returns the row of the item in the flattened tree.
+     *
+     * The row is computed by summing the offsets of the item and of its ancestors in their parent, this is O(depth)
+     * as long as the offsets are up to date. A change that shifts siblings (the insertion or the removal of a child, or
+     * a child subtree that grows or shrinks, other than the last one) marks the offsets of their parent stale, for each
+     * ancestor of the change (see resizeSubtree). The next call recomputes the stale offsets of the parents on its
+     * path, so the first row() after a change costs O(siblings on the path), e.g. O(n) after an insertion in the middle
+     * of a flat list of n rows, and the following ones O(depth). Appending children, as when a tree is built in order,
+     * keeps the offsets up to date.
+     */
     int row()
     {
-        return flattenedTree_.indexOf(this);
+        if (parent_ == nullptr)
+            return -1;
+        parent_->updateChildOffsets();
+        return parent_->row() + rowOffset_;
+    }
+
+    /**
+     * Returns the number of rows of the subtree, including the item itself.
+     *
+     * In visible rows only mode, the descendants of a collapsed item are not counted. The size does not depend on the
+     * state of the ancestors: it is the number of rows the subtree spans when the item itself is visible.
+     */
+    int subtreeSize() const
+    {
+        return subtreeSize_;
     }
 
     int indent() const
@@ -158,31 +444,166 @@ public:
         return isHidden_;
     }
 
+    /**
+     * Returns true if the item is part of the flattened tree.
+     */
+    bool isRow() const
+    {
+        return parent_ != nullptr && (!context_->visibleRowsOnly || !isHidden_);
+    }
+
+    /**
+     * Returns whether the source item has children.
+     *
+     * The answer of the source model is cached, hasChildren may be expensive (e.g. it hits the disk for a
+     * QFileSystemModel) and the view asks for it for every delegate it creates. The cache is invalidated when rows are
+     * inserted or removed under the item (see invalidateHasChildren).
+     */
     bool hasChildren() const
     {
-        return proxyModel_->sourceModel()->hasChildren(sourceIndex());
+        if (!hasChildrenCached_) {
+            hasChildren_ = context_->proxyModel->sourceModel()->hasChildren(sourceIndex());
+            hasChildrenCached_ = true;
+        }
+        return hasChildren_;
+    }
+
+    /**
+     * Records that the source item has children, when its rows have been counted anyway (see TreeViewModel::flatten).
+     */
+    void setHasChildren()
+    {
+        hasChildren_ = true;
+        hasChildrenCached_ = true;
+    }
+
+    void invalidateHasChildren()
+    {
+        hasChildrenCached_ = false;
+    }
+
+    /**
+     * Returns true once the items of the children have been created (see TreeViewModel::flatten).
+     */
+    bool childrenMaterialized() const
+    {
+        return childrenMaterialized_;
+    }
+
+    void setChildrenMaterialized()
+    {
+        childrenMaterialized_ = true;
     }
 
+    /**
+     * Returns the row of the last descendant of the item in the flattened tree (or the row of the item itself if none
+     * of its descendants is a row).
+     *
+     * The subtree of an item spans a contiguous block of rows, so this is as cheap as row().
+     */
     int getLastChildRow()
     {
-        if (childItems_.count() > 0) {
-            TreeItemViewModel *lastChild = childItems_.last();
-            return lastChild->getLastChildRow();
-        }
-        else
-            return row();
+        return row() + subtreeSize_ - 1;
     }
 
 private:
+    bool childrenAreRows() const
+    {
+        return !context_->visibleRowsOnly || isExpanded_;
+    }
+
+    void onChildInserted(TreeItemViewModel* child)
+    {
+        if (childrenAreRows())
+            resizeSubtree(child->subtreeSize_);
+    }
+
+    /**
+     * Adds delta to the subtree size of the item and of the ancestors that count it and invalidates the offsets of
+     * the siblings that follow them.
+     *
+     * The offsets of a parent are only recomputed, all at once, when a row under it is needed (see updateChildOffsets).
+     */
+    void resizeSubtree(int delta)
+    {
+        for (TreeItemViewModel* item = this; ; item = item->parent_) {
+            item->subtreeSize_ += delta;
+            // the size of a detached subtree is added to its parent when it is attached (see insertChildren)
+            if (item->parent_ == nullptr || !item->isAttached_)
+                break;
+            // growing the last child does not shift any sibling, this keeps building a tree in order linear
+            if (item->parent_->childItems_.last() != item)
+                item->parent_->childOffsetsDirty_ = true;
+            if (!item->parent_->childrenAreRows())
+                break;
+        }
+    }
+
+    /**
+     * Applies setSubtreeExpanded to the descendants and returns the new subtree size of the item, which is left for the
+     * caller to set.
+     */
+    int applySubtreeExpanded(int levels)
+    {
+        // the root item is always expanded, the leaves are left collapsed
+        bool expanded = parent_ == nullptr || (levels != 0 && (!childItems_.isEmpty() || hasChildren()));
+        if (expanded != isExpanded_ && parent_ != nullptr) {
+            if (expanded)
+                context_->expandedIndexes.insert(sourceIndexAcrossProxyChain(sourceIndex_));
+            else
+                context_->expandedIndexes.remove(sourceIndexAcrossProxyChain(sourceIndex_));
+        }
+        isExpanded_ = expanded;
+
+        int size = 1;
+        for (TreeItemViewModel* child: childItems_) {
+            child->isHidden_ = isHidden_ || !isExpanded_;
+            child->subtreeSize_ = child->applySubtreeExpanded(levels > 0 ? levels - 1 : levels);
+            if (childrenAreRows())
+                size += child->subtreeSize_;
+        }
+        childOffsetsDirty_ = true;
+        return size;
+    }
+
+    void updateIndentAndHiddenState()
+    {
+        indent_ = parent_->indent_ + 1;
+        isHidden_ = !parent_->isExpanded_ || parent_->isHidden_;
+        for (TreeItemViewModel* child: childItems_)
+            child->updateIndentAndHiddenState();
+    }
+
+    /**
+     * Recomputes the offsets of all the children if they are stale, in O(children).
+     */
+    void updateChildOffsets()
+    {
+        if (!childOffsetsDirty_)
+            return;
+        int offset = 1;
+        for (TreeItemViewModel* child: childItems_) {
+            child->rowOffset_ = offset;
+            offset += child->subtreeSize_;
+        }
+        childOffsetsDirty_ = false;
+    }
+
     QPersistentModelIndex sourceIndex_;
-    int indent_;
-    bool isExpanded_;
-    bool isHidden_;
+    // number of rows of the subtree (including this item) and row of this item relative to the row of its parent
+    int subtreeSize_;
+    int rowOffset_;
+    int indent_ : 16;
+    uint isExpanded_ : 1;
+    uint isHidden_ : 1;
+    uint childOffsetsDirty_ : 1;
+    uint childrenMaterialized_ : 1;
+    uint isAttached_ : 1;
+    // hasChildren of the source item, once it has been asked for
+    mutable uint hasChildrenCached_ : 1;
+    mutable uint hasChildren_ : 1;
 
     TreeItemViewModel* parent_;
-    QAbstractProxyModel* proxyModel_;
-    QList<TreeItemViewModel*>& flattenedTree_;
+    TreeItemViewModelContext* context_;
     QList<TreeItemViewModel*> childItems_;
-    QMap<QModelIndex, bool>& expandedMap_;
-    QMap<QModelIndex, bool>& hiddenMap_;
 };
@@ -1,8 +1,19 @@
 #pragma once
 
 #include <QAbstractProxyModel>
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QFutureInterface>
+#include <QJSValue>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QSet>
+#include <QStringList>
+#include <QTimer>
+#include <algorithm>
+#include <climits>
 #include "TreeItemViewModel.h"
-#include <QDebug>
+#include "SequenceDiff.h"
 
 /**
  * @brief Proxy model that flattens any source TreeModel to make it suitable to display in a qml ListView (see TreeView.qml).
@@ -16,6 +27,9 @@
  * Use the setSourceModel method to set the source TreeModel (e.g. QFileSystemModel)
  */
 class TreeViewModel: public QAbstractProxyModel {
+    Q_OBJECT
+    Q_PROPERTY(bool loading READ isLoading NOTIFY loadingChanged)
+    Q_PROPERTY(qreal loadingProgress READ loadingProgress NOTIFY loadingProgressChanged)
 public:
     enum TreeRoles {
         Indentation = Qt::UserRole + 1,
@@ -24,38 +38,459 @@ public:
         Hidden
     };
 
-    TreeViewModel(QObject* parent= nullptr) : QAbstractProxyModel(parent)
+    TreeViewModel(QObject* parent= nullptr) :
+        QAbstractProxyModel(parent),
+        itemContext_{visibleRowsOnly_, itemsByIndex_, itemPool_, this, proxyChain_, expandedIndexes_}
     {
+        loadingTimer_.setSingleShot(true);
+        connect(&loadingTimer_, &QTimer::timeout, this, &TreeViewModel::loadNextRows);
+        fetchTimer_.setSingleShot(true);
+        connect(&fetchTimer_, &QTimer::timeout, this, &TreeViewModel::dispatchFetches);
+        fetchClock_.start();
+        prefetchTimer_.setSingleShot(true);
+        connect(&prefetchTimer_, &QTimer::timeout, this, &TreeViewModel::prefetchVisibleItems);
+        revealTimer_.setSingleShot(true);
+        connect(&revealTimer_, &QTimer::timeout, this, &TreeViewModel::advanceRevealRequests);
     }
 
-//    /**
-//     * Sets the root item to the item at the given source index.
-//     *
-//     * This is equivalent to QTreeView::setRootIndex
-//     *
-//     * @param sourceRootIndex root index from sourceModel
-//     */
-//    void setRootIndex(const QModelIndex &sourceRootIndex)
-//    {
-//        // TODO
-//        beginResetModel();
-//        rootItem_ = findItemByIndex(sourceRootIndex);
-//
-//        endResetModel();
-//    }
+    ~TreeViewModel() override
+    {
+        // the pending futures are not left waiting, the QML callbacks are not called from the destructor
+        for (RevealRequest& request: revealRequests_) {
+            request.result.reportResult(-1);
+            request.result.reportFinished();
+        }
+        clearItems();
+    }
+
+    /**
+     * Sets whether the model only exposes the visible rows.
+     *
+     * By default, every item of the source tree is a row and the descendants of a collapsed item are flagged as hidden.
+     * When enabled, only the items whose ancestors are all expanded are rows: expanding an item inserts the rows of its
+     * revealed descendants and collapsing it removes them. This keeps the number of rows managed by the view
+     * proportional to what can actually be seen.
+     *
+     * Changing the mode resets the model.
+     */
+    void setVisibleRowsOnly(bool visibleRowsOnly)
+    {
+        if (visibleRowsOnly == visibleRowsOnly_)
+            return;
+        visibleRowsOnly_ = visibleRowsOnly;
+        doResetModel(sourceModel());
+    }
+
+    bool visibleRowsOnly() const
+    {
+        return visibleRowsOnly_;
+    }
+
+    /**
+     * Sets whether a reset of the source model is applied as a diff instead of resetting the model.
+     *
+     * A reset rebuilds every delegate of the view. When enabled, the rows are identified by a stable key (the path of
+     * the values of the key role from the top level item, see itemKey) that is used to restore the expanded items and
+     * to emit the minimal set of row removals, moves and insertions that turn the old rows into the new ones. The model
+     * is still reset when the rows differ too much (see maxResetDiffDifferences).
+     *
+     * This also applies to the layout changes that are not a reordering of siblings.
+     */
+    void setDiffOnReset(bool diffOnReset)
+    {
+        diffOnReset_ = diffOnReset;
+    }
+
+    bool diffOnReset() const
+    {
+        return diffOnReset_;
+    }
+
+    /**
+     * Sets the time, in milliseconds, during which the items may be built before the event loop is given back.
+     *
+     * By default (0), a reset builds all the items at once, which blocks the event loop for as long as the traversal of
+     * the source tree takes. Otherwise, a reset only builds the rows it can in the given time and the remaining ones are
+     * built in slices of the same duration, from a timer, and appended with row insertions. A budget of a few
+     * milliseconds (e.g. 8, half of a frame at 60 Hz) keeps the view responsive, the rows built so far can be scrolled
+     * while the others are being built (see loading and loadingProgress).
+     *
+     * A change of the source model under an item whose children are still being built finishes the loading first.
+     */
+    void setLoadingTimeBudget(int msecs)
+    {
+        loadingTimeBudget_ = std::max(msecs, 0);
+    }
+
+    int loadingTimeBudget() const
+    {
+        return loadingTimeBudget_;
+    }
+
+    /**
+     * Returns whether rows remain to be built after a reset (see setLoadingTimeBudget).
+     */
+    bool isLoading() const
+    {
+        return !loadingFrames_.isEmpty();
+    }
+
+    /**
+     * Returns the estimated part of the source tree that has been built, from 0 to 1.
+     *
+     * The share of each item is split equally between its children, the remaining rows not being known in advance.
+     */
+    qreal loadingProgress() const
+    {
+        if (!isLoading())
+            return 1;
+        qreal progress = 0;
+        qreal share = 1;
+        for (int i = 0; i < loadingFrames_.count(); ++i) {
+            const FlattenFrame& frame = loadingFrames_[i];
+            if (frame.rowCount == 0)
+                break;
+            // the child being built is accounted for by the next frame
+            int builtRows = i + 1 < loadingFrames_.count() ? frame.nextRow - 1 : frame.nextRow;
+            progress += share * builtRows / frame.rowCount;
+            share /= frame.rowCount;
+        }
+        return progress;
+    }
+
+    /**
+     * Sets the maximum number of fetches of the source model in flight at once, 4 by default (0 for no limit).
+     *
+     * Expanding an item fetches its children when the source model loads them lazily (see
+     * QAbstractItemModel::fetchMore), e.g. a QFileSystemModel reads the directory in a thread. The fetches are queued
+     * and started by priority, the items whose row is in or closest to the visible range first (see setVisibleRange),
+     * so that expanding many items at once does not start all their loads at once. A fetch is in flight until the
+     * source model inserts rows under its item, or for fetchTimeout milliseconds (see setFetchTimeout). The queued
+     * fetch of an item that is collapsed or removed is dropped.
+     */
+    void setMaxFetchesInFlight(int maxFetchesInFlight)
+    {
+        maxFetchesInFlight_ = std::max(maxFetchesInFlight, 0);
+        dispatchFetches();
+    }
+
+    int maxFetchesInFlight() const
+    {
+        return maxFetchesInFlight_;
+    }
+
+    /**
+     * Sets the time in milliseconds after which a fetch that did not insert any row is no longer counted as in flight,
+     * 1000 by default.
+     *
+     * A fetch ends when the source model inserts the first rows under its item, a source model that inserts the
+     * children in several batches (e.g. QFileSystemModel for a large directory) may still be loading them. The timeout
+     * lets the next fetches start when a fetch inserts no row at all (e.g. for an empty directory), it should exceed
+     * the time the source model takes to insert the first rows (e.g. a remote or database model).
+     */
+    void setFetchTimeout(int fetchTimeout)
+    {
+        fetchTimeout_ = std::max(fetchTimeout, 0);
+        dispatchFetches();
+    }
+
+    int fetchTimeout() const
+    {
+        return fetchTimeout_;
+    }
+
+    /**
+     * Sets the range of rows displayed by the view (TreeView.qml reports it as the view scrolls), the fetches of the
+     * items in or near it are started first (see setMaxFetchesInFlight). By default, all the rows are considered
+     * visible.
+     */
+    Q_INVOKABLE void setVisibleRange(int firstRow, int lastRow)
+    {
+        visibleFirstRow_ = firstRow;
+        visibleLastRow_ = lastRow;
+        if (prefetchDepth_ > 0)
+            prefetchTimer_.start(prefetchDelay);
+    }
+
+    /**
+     * Sets the number of levels of descendants of the visible collapsed items that are fetched in advance, 0 (no
+     * prefetch) by default.
+     *
+     * Expanding an item whose children are loaded lazily shows nothing until the source model has fetched them. When
+     * the visible range (see setVisibleRange) has not changed for prefetchDelay milliseconds, the children of the
+     * visible collapsed items are fetched, down to the given depth, so that expanding them is instant. The prefetches
+     * only start when no fetch of an expanded item is queued, and they count in the fetches in flight.
+     */
+    void setPrefetchDepth(int prefetchDepth)
+    {
+        prefetchDepth_ = std::max(prefetchDepth, 0);
+    }
+
+    int prefetchDepth() const
+    {
+        return prefetchDepth_;
+    }
+
+    /**
+     * Sets the maximum number of source rows that the prefetch may load, 10000 by default.
+     *
+     * A source model cannot release the rows it fetched, so the prefetch stops once the items it fetched, and that
+     * have not been expanded since, have that many children. The budget is checked before each prefetch is started,
+     * the prefetches in flight (see setMaxFetchesInFlight) may exceed it by the rows they load.
+     */
+    void setPrefetchBudget(int rows)
+    {
+        prefetchBudget_ = std::max(rows, 0);
+    }
+
+    int prefetchBudget() const
+    {
+        return prefetchBudget_;
+    }
+
+    /**
+     * Sets the source role whose values identify the items, Qt::DisplayRole by default.
+     *
+     * The key of an item is the path of the values of this role from the top level item (see itemKey). It is used to
+     * save and restore the expanded items and to apply the resets of the source model as a diff, so the role should
+     * hold values that are unique among siblings and stable across resets and sessions (e.g. a file name or an id).
+     */
+    void setKeyRole(int keyRole)
+    {
+        keyRole_ = keyRole;
+    }
+
+    int keyRole() const
+    {
+        return keyRole_;
+    }
+
+    /**
+     * Returns the keys of the expanded items, as a compact JSON array, for use with restoreExpandedState.
+     *
+     * The rows that remain to be built are built first (see setLoadingTimeBudget).
+     */
+    QByteArray saveExpandedState()
+    {
+        finishLoading();
+        QSet<QString> expandedKeys;
+        if (rootItem_ != nullptr)
+            appendItemKeys(rootItem_, QString(), nullptr, &expandedKeys);
+        QStringList keys = expandedKeys.toList();
+        keys.sort();
+        return QJsonDocument(QJsonArray::fromStringList(keys)).toJson(QJsonDocument::Compact);
+    }
+
+    /**
+     * Expands the items whose key is in the given state (see saveExpandedState) and collapses the others.
+     *
+     * The items are rebuilt in a single pass, the expanded state being applied as they are created. The model is
+     * reset, unless the resets are applied as a diff (see setDiffOnReset).
+     *
+     * @return false if the state could not be parsed, in that case the model is left unchanged.
+     */
+    bool restoreExpandedState(const QByteArray& state)
+    {
+        QJsonDocument document = QJsonDocument::fromJson(state);
+        if (!document.isArray())
+            return false;
+        QSet<QString> expandedKeys;
+        for (const QJsonValue& key: document.array())
+            expandedKeys.insert(key.toString());
+
+        if (diffOnReset_) {
+            takeResetSnapshot();
+            resetSnapshotExpandedKeys_ = expandedKeys;
+            applyResetDiff();
+        }
+        else {
+            beginResetModel();
+            expandedIndexes_.clear();
+            setRestoredExpandedKeys(expandedKeys);
+            rebuildItems(sourceModel());
+            endResetModel();
+        }
+        return true;
+    }
+
+    /**
+     * Expands every item of the source tree.
+     *
+     * Like the other bulk operations, the items are updated in a single traversal and the change is notified at once:
+     * with a range of changed rows or, in visible rows only mode, with a reset.
+     */
+    Q_INVOKABLE void expandAll()
+    {
+        setSubtreeExpanded(rootItem_, -1);
+    }
+
+    /**
+     * Collapses every item of the source tree.
+     */
+    Q_INVOKABLE void collapseAll()
+    {
+        setSubtreeExpanded(rootItem_, 1);
+    }
+
+    /**
+     * Expands the items down to the given depth, the top level items being at depth 0, and collapses the deeper ones.
+     */
+    Q_INVOKABLE void expandToDepth(int depth)
+    {
+        // the root item is the first level
+        setSubtreeExpanded(rootItem_, std::max(depth, -1) + 2);
+    }
+
+    /**
+     * Expands the item at the given row and all its descendants.
+     *
+     * In visible rows only mode, the rows of the descendants of the item are replaced as a single block.
+     */
+    Q_INVOKABLE void expandRecursively(int row)
+    {
+        if (row < 0 || row >= flattenedTree_.count())
+            return;
+        setSubtreeExpanded(flattenedTree_[row], -1);
+    }
+
+    /**
+     * Expands the ancestors of the item at the given path and returns a future that resolves with the row of the item,
+     * once its ancestors are loaded. The future resolves with -1 if the item is not found within timeout milliseconds,
+     * since the source model may still insert it (e.g. in a later batch of the children of an ancestor).
+     *
+     * The path is made of the values of the key role (see setKeyRole) of the item and of its ancestors, from the top
+     * level item, e.g. the names of the directories of a file. On a source model that loads its rows lazily, the
+     * children of each ancestor are fetched in turn (see setMaxFetchesInFlight) before its child is looked up.
+     */
+    QFuture<int> revealPath(const QStringList& path, int timeout = 5000)
+    {
+        return startRevealRequest(path, false, timeout, QJSValue());
+    }
+
+    /**
+     * Same as revealPath, the item is expanded too and the future resolves once its children are loaded.
+     */
+    QFuture<int> expandPath(const QStringList& path, int timeout = 5000)
+    {
+        return startRevealRequest(path, true, timeout, QJSValue());
+    }
+
+    /**
+     * Version of revealPath for QML, the callback is called with the row of the item, or -1.
+     */
+    Q_INVOKABLE void revealPath(const QStringList& path, const QJSValue& callback, int timeout = 5000)
+    {
+        startRevealRequest(path, false, timeout, callback);
+    }
+
+    /**
+     * Version of expandPath for QML, the callback is called with the row of the item, or -1.
+     */
+    Q_INVOKABLE void expandPath(const QStringList& path, const QJSValue& callback, int timeout = 5000)
+    {
+        startRevealRequest(path, true, timeout, callback);
+    }
+
+    /**
+     * Sets the root item to the item at the given source index.
+     *
+     * This is equivalent to QTreeView::setRootIndex: only the descendants of the root index get items and are rows,
+     * the signals of the source model about the rows outside of its subtree are ignored. The items that have already
+     * been created are reused when the new root is a descendant of the current one, or one of its ancestors. Like with
+     * QTreeView, the root index goes back to the invalid index (the whole tree) when it is removed from the source
+     * model or when the source model is reset.
+     *
+     * The model is reset.
+     *
+     * @param sourceRootIndex root index from sourceModel
+     */
+    void setRootIndex(const QModelIndex &sourceRootIndex)
+    {
+        if (sourceRootIndex == rootIndex_ || sourceModel() == nullptr)
+            return;
+        // the items of the current tree are reused, they have to be complete
+        finishLoading();
+
+        // the path from the new root down to the current one, if the new root is one of its ancestors
+        QModelIndexList pathToCurrentRoot;
+        QModelIndex index = rootIndex_;
+        while (index.isValid() && index != sourceRootIndex) {
+            pathToCurrentRoot.prepend(index);
+            index = index.parent();
+        }
+        bool isAncestor = rootIndex_.isValid() && index == sourceRootIndex;
+        TreeItemViewModel* item = findItemByIndex(sourceRootIndex);
+
+        beginResetModel();
+        TreeItemViewModel* oldRoot = rootItem_;
+        rootIndex_ = sourceRootIndex;
+        if (item != nullptr) {
+            // the subtree of the new root is kept, the rest of the tree is destroyed
+            item->parent()->takeChildren(sourceRootIndex.row(), 1);
+            itemsByIndex_.remove(item->sourceIndex());
+            oldRoot->unregisterSubtree();
+            destroyItems(oldRoot);
+            item->makeRoot();
+            rootItem_ = item;
+            if (!rootItem_->childrenMaterialized()) {
+                QList<TreeItemViewModel*> rows;
+                flatten(sourceModel(), rootItem_, rows);
+            }
+            flattenedTree_.clear();
+            rootItem_->appendDescendantRows(flattenedTree_);
+        }
+        else if (isAncestor) {
+            // the subtree of the current root is grafted when flatten reaches its source index
+            flattenedTree_.clear();
+            reusedRootPath_ = pathToCurrentRoot;
+            reusedRoot_ = oldRoot;
+            rootItem_ = itemPool_.create(&itemContext_, rootIndex_);
+            flatten(sourceModel(), rootItem_, flattenedTree_);
+            if (reusedRoot_ != nullptr) {
+                reusedRoot_->unregisterSubtree();
+                destroyItems(reusedRoot_);
+                reusedRoot_ = nullptr;
+            }
+            reusedRootPath_.clear();
+        }
+        else
+            rebuildItems(sourceModel());
+        endResetModel();
+    }
+
+    QModelIndex rootIndex() const
+    {
+        return rootIndex_;
+    }
 
     // QAbstactProxyModel implementation
     void setSourceModel(QAbstractItemModel *sourceModel) override
     {
+        if (this->sourceModel() != nullptr)
+            disconnect(this->sourceModel(), nullptr, this, nullptr);
+
         QAbstractProxyModel::setSourceModel(sourceModel);
 
+        rootIndex_ = QPersistentModelIndex();
+        pendingFetches_.clear();
+        fetchesInFlight_.clear();
+        pendingPrefetches_.clear();
+        prefetchedIndexes_.clear();
+        updateProxyChain();
         doResetModel(sourceModel);
 
         if (sourceModel != nullptr) {
             connect(sourceModel, &QAbstractItemModel::dataChanged, this, &TreeViewModel::onSourceDataChanged);
+            connect(sourceModel, &QAbstractItemModel::rowsAboutToBeInserted, this, &TreeViewModel::onRowsAboutToBeInserted);
             connect(sourceModel, &QAbstractItemModel::rowsInserted, this, &TreeViewModel::onRowsInserted);
+            connect(sourceModel, &QAbstractItemModel::rowsAboutToBeRemoved, this, &TreeViewModel::onRowsAboutToBeRemoved);
             connect(sourceModel, &QAbstractItemModel::rowsRemoved, this, &TreeViewModel::onRowsRemoved);
+            connect(sourceModel, &QAbstractItemModel::rowsAboutToBeMoved, this, &TreeViewModel::onRowsAboutToBeMoved);
             connect(sourceModel, &QAbstractItemModel::rowsMoved, this, &TreeViewModel::onRowsMoved);
+            connect(sourceModel, &QAbstractItemModel::modelAboutToBeReset, this, &TreeViewModel::onModelAboutToBeReset);
+            connect(sourceModel, &QAbstractItemModel::modelReset, this, &TreeViewModel::onModelReset);
+            connect(sourceModel, &QAbstractItemModel::layoutAboutToBeChanged, this,
+                    &TreeViewModel::onLayoutAboutToBeChanged);
             connect(sourceModel, &QAbstractItemModel::layoutChanged, this, &TreeViewModel::onLayoutChanged);
         }
     }
@@ -70,7 +505,7 @@ public:
     QModelIndex mapFromSource(const QModelIndex &sourceIndex) const override
     {
         TreeItemViewModel* n = findItemByIndex(sourceIndex);
-        if (n == nullptr)
+        if (n == nullptr || !n->isRow())
             return QModelIndex();
         return createIndex(n->row(), 0);
     }
@@ -121,9 +556,9 @@ public:
         switch (role) {
             case IsExpanded:
                 toggleIsExpanded(proxyIndex.row(), value.toBool());
-                break;
+                return true;
             default:
-                QAbstractProxyModel::setData(proxyIndex, value, role);
+                return QAbstractProxyModel::setData(proxyIndex, value, role);
         }
     }
 
@@ -137,104 +572,1672 @@ public:
         return names;
     }
 
+signals:
+    void loadingChanged();
+    void loadingProgressChanged();
+
 private slots:
-    void onLayoutChanged()
+    void onLayoutAboutToBeChanged(const QList<QPersistentModelIndex>& parents,
+                                  QAbstractItemModel::LayoutChangeHint hint)
     {
-        qDebug() << "onLayoutChanged";
-        doResetModel(sourceModel());
-    };
+        layoutChangeParents_.clear();
+        layoutChangePersistentIndexes_.clear();
+        layoutChangePersistentItems_.clear();
+        // the order of the rows does not change when the columns are sorted
+        if (hint == QAbstractItemModel::HorizontalSortHint) {
+            emit layoutAboutToBeChanged(QList<QPersistentModelIndex>(), hint);
+            return;
+        }
+
+        // the rows that remain to be built are inserted before the layout change is announced
+        if (parents.isEmpty())
+            finishLoading();
+        for (const QPersistentModelIndex& parent: parents)
+            finishLoadingUnder(parent);
+        emit layoutAboutToBeChanged(QList<QPersistentModelIndex>(), hint);
+
+        // the persistent indexes are remapped through their item, that is kept across the layout change
+        layoutChangePersistentIndexes_ = persistentIndexList();
+        for (const QModelIndex& proxyIndex: layoutChangePersistentIndexes_) {
+            int row = proxyIndex.row();
+            layoutChangePersistentItems_.append(row < flattenedTree_.count() ? flattenedTree_[row] : nullptr);
+        }
+
+        // only the children of the given parents are reordered, no parent means that all of them may be
+        if (parents.isEmpty())
+            appendMaterializedItems(rootItem_, layoutChangeParents_);
+        else {
+            for (const QPersistentModelIndex& parent: parents) {
+                TreeItemViewModel* parentNode = findMaterializedItem(parent);
+                if (parentNode != nullptr)
+                    layoutChangeParents_.append(parentNode);
+            }
+        }
+    }
 
-    void onSourceDataChanged(QModelIndex topLeft, QModelIndex bottomRight)
+    void onLayoutChanged(const QList<QPersistentModelIndex>& parents, QAbstractItemModel::LayoutChangeHint hint)
     {
-        qDebug() << "onSourceDataChanged";
-        emit dataChanged(mapFromSource(topLeft), mapFromSource(bottomRight));
+        if (hint == QAbstractItemModel::HorizontalSortHint) {
+            emit layoutChanged(QList<QPersistentModelIndex>(), hint);
+            return;
+        }
+
+        // a layout change that is not a reordering of siblings (e.g. items that changed parent) is handled by a reset
+        if (!layoutChangeIsSiblingsReordering()) {
+            layoutChangeParents_.clear();
+            emit layoutChanged(QList<QPersistentModelIndex>(), hint);
+            if (diffOnReset_) {
+                // the items still have valid (persistent) source indexes, their keys are read from the new layout
+                takeResetSnapshot();
+                applyResetDiff();
+            }
+            else
+                doResetModel(sourceModel());
+            return;
+        }
+
+        for (TreeItemViewModel* parentNode: layoutChangeParents_)
+            parentNode->sortChildrenBySourceRow();
+        // only the persistent indexes are guaranteed to be valid after a layout change, the source indexes of the items
+        // outside of the reordered sibling groups may have changed too (e.g. QSortFilterProxyModel recreates all its
+        // mappings, which changes the internal id of its indexes)
+        itemsByIndex_.clear();
+        for (int position = 0; position < rootItem_->childCount(); ++position)
+            rootItem_->child(position)->registerSubtree();
+
+        // rewrite the rows of the reordered sibling groups only, their subtrees keep the same span
+        if (parents.isEmpty()) {
+            flattenedTree_.clear();
+            rootItem_->appendDescendantRows(flattenedTree_);
+        }
+        else {
+            for (TreeItemViewModel* parentNode: layoutChangeParents_) {
+                if (!parentNode->childrenAreInFlattenedTree())
+                    continue;
+                QList<TreeItemViewModel*> rows;
+                parentNode->appendDescendantRows(rows);
+                int firstRow = parentNode->row() + 1;
+                for (int i = 0; i < rows.count(); ++i)
+                    flattenedTree_[firstRow + i] = rows[i];
+            }
+        }
+
+        QModelIndexList newPersistentIndexes;
+        for (int i = 0; i < layoutChangePersistentIndexes_.count(); ++i) {
+            TreeItemViewModel* item = layoutChangePersistentItems_[i];
+            if (item != nullptr && item->isRow())
+                newPersistentIndexes.append(index(item->row(), layoutChangePersistentIndexes_[i].column()));
+            else
+                newPersistentIndexes.append(QModelIndex());
+        }
+        changePersistentIndexList(layoutChangePersistentIndexes_, newPersistentIndexes);
+
+        layoutChangeParents_.clear();
+        layoutChangePersistentIndexes_.clear();
+        layoutChangePersistentItems_.clear();
+        emit layoutChanged(QList<QPersistentModelIndex>(), hint);
+    }
+
+    void onModelAboutToBeReset()
+    {
+        if (diffOnReset_)
+            takeResetSnapshot();
+        else {
+            // the persistent indexes of the expanded items are about to be invalidated, they are restored by key,
+            // along with the keys that the loading has not applied yet (see setLoadingTimeBudget)
+            if (!expandedIndexes_.isEmpty() || !restoredExpandedKeys_.isEmpty()) {
+                QSet<QString> expandedKeys = restoredExpandedKeys_;
+                appendItemKeys(rootItem_, QString(), nullptr, &expandedKeys);
+                setRestoredExpandedKeys(expandedKeys);
+            }
+            beginResetModel();
+        }
+    }
+
+    void onModelReset()
+    {
+        if (diffOnReset_)
+            applyResetDiff();
+        else {
+            rebuildItems(sourceModel());
+            endResetModel();
+        }
+    }
+
+    void onSourceDataChanged(const QModelIndex& topLeft, const QModelIndex& bottomRight, const QVector<int>& roles)
+    {
+        TreeItemViewModel* parentNode = findMaterializedItem(topLeft.parent());
+        if (parentNode == nullptr)
+            return;
+
+        // sibling rows are separated by the rows of their descendants in the flattened tree, each contiguous span of
+        // rows is notified separately with the roles of the source model, the tree roles are not affected
+        int spanFirst = -1;
+        int spanLast = -1;
+        int last = std::min(bottomRight.row(), parentNode->childCount() - 1);
+        for (int position = topLeft.row(); position <= last; ++position) {
+            TreeItemViewModel* child = parentNode->child(position);
+            if (!child->isRow())
+                continue;
+            int row = child->row();
+            if (spanFirst != -1 && row != spanLast + 1) {
+                emit dataChanged(index(spanFirst, 0), index(spanLast, 0), roles);
+                spanFirst = -1;
+            }
+            if (spanFirst == -1)
+                spanFirst = row;
+            spanLast = row;
+        }
+        if (spanFirst != -1)
+            emit dataChanged(index(spanFirst, 0), index(spanLast, 0), roles);
+    }
+
+    void onRowsAboutToBeInserted(const QModelIndex& parent, int first, int last)
+    {
+        Q_UNUSED(last);
+
+        finishLoadingUnder(parent);
+
+        // the siblings after the insertion point are about to change row, so is their key in itemsByIndex_
+        shiftedItems_.clear();
+        if (findMaterializedItem(parent) == nullptr)
+            return;
+        int rows = sourceModel()->rowCount(parent);
+        for (int row = first; row < rows; ++row) {
+            TreeItemViewModel* n = itemsByIndex_.take(sourceModel()->index(row, 0, parent));
+            if (n != nullptr)
+                shiftedItems_.append(n);
+        }
     }
 
     void onRowsInserted(const QModelIndex& parent, int first, int last)
     {
+        reinsertShiftedKeys();
+
+        // the rows may be the ones a reveal request waits for
+        for (const RevealRequest& request: revealRequests_) {
+            if (request.item == parent) {
+                revealTimer_.start(0);
+                break;
+            }
+        }
+
+        // the rows outside of the tree of the root item are ignored
         TreeItemViewModel* parentNode = findItemByIndex(parent);
+        if (parentNode == nullptr)
+            return;
 
-        qDebug() << "onRowsInserted" << parent.data() << first << last;
+        parentNode->invalidateHasChildren();
+        completeFetch(parent);
+        if (sourceModel()->rowCount(parent) == last - first + 1)
+            notifyHasChildrenChanged(parentNode);
 
-        int firstRow = 0;
-        int lastRow = 0;
+        // the new children will be read from the source model when the parent is materialized
+        if (!parentNode->childrenMaterialized())
+            return;
 
-        for (int row = first; row < last + 1; ++row) {
-            QModelIndex childIndex = parent.child(row, 0);
-            TreeItemViewModel* n = parentNode->insertChild(row, childIndex);
-            if (row == first)
-                firstRow = n->row();
-            if (row == last)
-                lastRow = n->row();
-        }
-        beginInsertRows(QModelIndex(), firstRow, lastRow);
-        endInsertRows();
+        insertItems(parentNode, parent, first, last);
     }
 
-    void onRowsMoved(const QModelIndex &parent, int start, int end, const QModelIndex &destinationParent,
-                     int destinationRow)
+    void onRowsAboutToBeRemoved(const QModelIndex& parent, int first, int last)
     {
-        qDebug() << "onRowsMoved";
+        // the root item goes away with its subtree, the whole tree is shown instead (see setRootIndex)
+        if (rootIndex_.isValid() && isInRows(rootIndex_, parent, first, last)) {
+            rootRemoved_ = true;
+            beginResetModel();
+            return;
+        }
+        finishLoadingUnder(parent);
+        prepareRemoval(findMaterializedItem(parent), first, last);
     }
 
     void onRowsRemoved(const QModelIndex& parent, int first, int last)
     {
-        qDebug() << "onRowsRemoved";
+        Q_UNUSED(first);
+        Q_UNUSED(last);
+
+        if (rootRemoved_) {
+            rootRemoved_ = false;
+            rootIndex_ = QPersistentModelIndex();
+            rebuildItems(sourceModel());
+            endResetModel();
+            return;
+        }
+
+        applyRemoval();
+
+        TreeItemViewModel* parentNode = findItemByIndex(parent);
+        if (parentNode == nullptr)
+            return;
+        parentNode->invalidateHasChildren();
+        if (sourceModel()->rowCount(parent) == 0)
+            notifyHasChildrenChanged(parentNode);
+    }
+
+    void onRowsAboutToBeMoved(const QModelIndex& sourceParent, int start, int end, const QModelIndex& destinationParent,
+                              int destinationRow)
+    {
+        pendingMove_ = PendingMove();
+        shiftedItems_.clear();
+        finishLoadingUnder(sourceParent);
+        finishLoadingUnder(destinationParent);
+
+        TreeItemViewModel* sourceNode = findMaterializedItem(sourceParent);
+        TreeItemViewModel* destinationNode = findMaterializedItem(destinationParent);
+
+        if (sourceNode == nullptr) {
+            // the moved rows have no item yet, they are inserted like new rows if the destination has been materialized
+            if (destinationNode != nullptr) {
+                takeKeysOfChildren(destinationNode, destinationRow, destinationNode->childCount());
+                pendingMove_.kind = PendingMove::Insertion;
+                pendingMove_.destinationNode = destinationNode;
+            }
+            return;
+        }
+        if (destinationNode == nullptr) {
+            // the moved items leave the part of the tree that has been materialized
+            prepareRemoval(sourceNode, start, end);
+            pendingMove_.kind = PendingMove::Removal;
+            return;
+        }
+
+        // the keys of the moved items and of the siblings that are shifted have to be taken while the source indexes
+        // are still valid
+        for (int position = start; position <= end; ++position)
+            sourceNode->child(position)->unregisterSubtree();
+        takeKeysOfChildren(sourceNode, end + 1, sourceNode->childCount());
+        if (destinationNode != sourceNode)
+            takeKeysOfChildren(destinationNode, destinationRow, destinationNode->childCount());
+        else if (destinationRow < start)
+            takeKeysOfChildren(sourceNode, destinationRow, start);
+
+        pendingMove_.kind = PendingMove::Move;
+        pendingMove_.sourceNode = sourceNode;
+        pendingMove_.destinationNode = destinationNode;
+        pendingMove_.start = start;
+        pendingMove_.end = end;
+        pendingMove_.destinationRow = destinationRow;
+
+        // the moved subtrees span a contiguous block of rows, that is moved, removed or inserted at once depending on
+        // whether they are part of the flattened tree before and after the move
+        TreeItemViewModel* firstItem = sourceNode->child(start);
+        pendingMove_.sourceRows = firstItem->isRow();
+        pendingMove_.destinationRows = destinationNode->childrenAreInFlattenedTree();
+        for (int position = start; position <= end; ++position)
+            pendingMove_.rowCount += sourceNode->child(position)->subtreeSize();
+        if (pendingMove_.sourceRows)
+            pendingMove_.firstRow = firstItem->row();
+        if (pendingMove_.destinationRows)
+            pendingMove_.destinationFlatRow = destinationNode->insertionRow(destinationRow);
+
+        int firstRow = pendingMove_.firstRow;
+        int lastRow = firstRow + pendingMove_.rowCount - 1;
+        if (pendingMove_.sourceRows && pendingMove_.destinationRows) {
+            // moving a block right before or right after itself does not change the order of the rows
+            int destinationFlatRow = pendingMove_.destinationFlatRow;
+            if (destinationFlatRow < firstRow || destinationFlatRow > lastRow + 1)
+                pendingMove_.orderChanged = beginMoveRows(QModelIndex(), firstRow, lastRow, QModelIndex(),
+                                                          destinationFlatRow);
+        }
+        else if (pendingMove_.sourceRows)
+            beginRemoveRows(QModelIndex(), firstRow, lastRow);
+        else if (pendingMove_.destinationRows)
+            beginInsertRows(QModelIndex(), pendingMove_.destinationFlatRow,
+                            pendingMove_.destinationFlatRow + pendingMove_.rowCount - 1);
+    }
+
+    void onRowsMoved(const QModelIndex& sourceParent, int start, int end, const QModelIndex& destinationParent,
+                     int destinationRow)
+    {
+        switch (pendingMove_.kind) {
+            case PendingMove::Removal:
+                applyRemoval();
+                break;
+            case PendingMove::Insertion:
+                reinsertShiftedKeys();
+                insertItems(pendingMove_.destinationNode, destinationParent, destinationRow,
+                            destinationRow + end - start);
+                break;
+            case PendingMove::Move:
+                applyMove();
+                break;
+            default:
+                reinsertShiftedKeys();
+                break;
+        }
+        pendingMove_ = PendingMove();
+
+        for (const QModelIndex& parent: {sourceParent, destinationParent}) {
+            TreeItemViewModel* parentNode = findItemByIndex(parent);
+            if (parentNode != nullptr)
+                parentNode->invalidateHasChildren();
+        }
     }
 
 private:
-    int flatten(QAbstractItemModel *model, QModelIndex parent = QModelIndex(), TreeItemViewModel* parentNode= nullptr)
+    /**
+     * Children of parentNode whose items remain to be created by flatten, from nextRow on.
+     *
+     * The frames of a traversal are the path from its first item to the item whose children are being created, so that
+     * the traversal can be suspended and resumed (see setLoadingTimeBudget).
+     */
+    struct FlattenFrame
     {
-        if (parentNode == nullptr) {
-            qDeleteAll(flattenedTree_);
-            flattenedTree_.clear();
+        TreeItemViewModel* parentNode = nullptr;
+        int rowCount = 0;
+        int nextRow = 0;
+        // key of parentNode and occurrences of the keys of its children, to restore the expanded items
+        bool restoresExpandedState = false;
+        QString parentKey;
+        QHash<QString, int> keyOccurrences;
+    };
+
+    /**
+     * Call to revealPath or expandPath that waits for the rows of the items of its path to be loaded.
+     */
+    struct RevealRequest
+    {
+        QStringList path;
+        bool expandItem = false;
+        // source index of the deepest item of the path found so far and its depth in the path
+        QPersistentModelIndex item;
+        int depth = 0;
+        qint64 deadline = 0;
+        QFutureInterface<int> result;
+        QJSValue callback;
+    };
+
+    /**
+     * Creates the items of the given source rows and inserts their rows into the flattened tree.
+     *
+     * The new subtrees are built first, then all their rows are spliced into the flattened tree at once.
+     */
+    void insertItems(TreeItemViewModel* parentNode, const QModelIndex& parent, int first, int last)
+    {
+        QList<TreeItemViewModel*> children;
+        QList<TreeItemViewModel*> rows;
+        for (int row = first; row < last + 1; ++row) {
+            QModelIndex childIndex = sourceModel()->index(row, 0, parent);
+            TreeItemViewModel* n = parentNode->createChild(childIndex);
+            children.append(n);
+            if (n->isRow())
+                rows.append(n);
+            // the children of the new item are read the same way as during a reset
+            if (!visibleRowsOnly_ || n->isExpanded())
+                flatten(sourceModel(), n, rows);
         }
 
-        if (model == nullptr)
-            return 0;
+        if (rows.isEmpty()) {
+            parentNode->insertChildren(first, children);
+            return;
+        }
 
-        auto rows = model->rowCount(parent);
+        int firstRow = parentNode->insertionRow(first);
+        beginInsertRows(QModelIndex(), firstRow, firstRow + rows.count() - 1);
+        parentNode->insertChildren(first, children);
+        insertIntoFlattenedTree(firstRow, rows);
+        endInsertRows();
+    }
 
-        for(int rowIndex = 0; rowIndex < rows; ++rowIndex) {
-            QModelIndex index = model->index(rowIndex, 0, parent);
-            TreeItemViewModel* node = nullptr;
-            if (parentNode)
-                node = parentNode->addChild(index);
-            else
-                node = new TreeItemViewModel(parentNode, index, flattenedTree_, this, expandedMap_, hiddenMap);
+    /**
+     * Prepares the removal of the items of the given children of parentNode, before the source rows are removed.
+     *
+     * The keys of the removed items and of the siblings that are shifted up are taken while the source indexes are
+     * still valid, and the removal of the rows of the removed subtrees is announced. It is applied by applyRemoval.
+     */
+    void prepareRemoval(TreeItemViewModel* parentNode, int first, int last)
+    {
+        pendingRemoval_ = PendingRemoval();
+        shiftedItems_.clear();
+
+        // the items of the children of a parent that has not been materialized have not been created
+        if (parentNode == nullptr || parentNode->childCount() <= last)
+            return;
+
+        for (int position = first; position <= last; ++position)
+            parentNode->child(position)->unregisterSubtree();
+        takeKeysOfChildren(parentNode, last + 1, parentNode->childCount());
+
+        pendingRemoval_.parentNode = parentNode;
+        pendingRemoval_.first = first;
+        pendingRemoval_.last = last;
+
+        // the subtrees of the removed children span a contiguous block of rows
+        if (parentNode->child(first)->isRow()) {
+            pendingRemoval_.firstRow = parentNode->child(first)->row();
+            for (int position = first; position <= last; ++position)
+                pendingRemoval_.rowCount += parentNode->child(position)->subtreeSize();
+            beginRemoveRows(QModelIndex(), pendingRemoval_.firstRow,
+                            pendingRemoval_.firstRow + pendingRemoval_.rowCount - 1);
+        }
+    }
+
+    void applyRemoval()
+    {
+        reinsertShiftedKeys();
+
+        if (pendingRemoval_.parentNode == nullptr)
+            return;
+
+        pendingRemoval_.parentNode->removeChildren(pendingRemoval_.first,
+                                                   pendingRemoval_.last - pendingRemoval_.first + 1);
+        if (pendingRemoval_.rowCount > 0) {
+            flattenedTree_.erase(flattenedTree_.begin() + pendingRemoval_.firstRow,
+                                 flattenedTree_.begin() + pendingRemoval_.firstRow + pendingRemoval_.rowCount);
+            endRemoveRows();
+        }
+        pendingRemoval_ = PendingRemoval();
+    }
+
+    /**
+     * Moves the items announced in onRowsAboutToBeMoved to their new parent and updates the flattened tree.
+     */
+    void applyMove()
+    {
+        const PendingMove& move = pendingMove_;
+        int count = move.end - move.start + 1;
+        QList<TreeItemViewModel*> items = move.sourceNode->takeChildren(move.start, count);
+        int position = move.destinationRow;
+        if (move.destinationNode == move.sourceNode && move.destinationRow > move.end)
+            position -= count;
+        for (TreeItemViewModel* item: items)
+            item->reparent(move.destinationNode);
+        move.destinationNode->insertChildren(position, items);
+
+        for (TreeItemViewModel* item: items)
+            item->registerSubtree();
+        reinsertShiftedKeys();
+
+        if (move.sourceRows && move.destinationRows) {
+            auto first = flattenedTree_.begin() + move.firstRow;
+            auto last = first + move.rowCount;
+            auto destination = flattenedTree_.begin() + move.destinationFlatRow;
+            if (destination < first)
+                std::rotate(destination, first, last);
+            else if (destination > last)
+                std::rotate(first, last, destination);
+            if (move.orderChanged)
+                endMoveRows();
+
+            // the indentation (and the hidden state) of the moved rows change with their parent
+            if (move.destinationNode != move.sourceNode) {
+                int firstRow = items.first()->row();
+                emit dataChanged(index(firstRow), index(firstRow + move.rowCount - 1),
+                                 QVector<int>{Indentation, Hidden});
+            }
+        }
+        else if (move.sourceRows) {
+            flattenedTree_.erase(flattenedTree_.begin() + move.firstRow,
+                                 flattenedTree_.begin() + move.firstRow + move.rowCount);
+            endRemoveRows();
+        }
+        else if (move.destinationRows) {
+            QList<TreeItemViewModel*> rows;
+            for (TreeItemViewModel* item: items) {
+                rows.append(item);
+                if (item->isExpanded())
+                    item->appendDescendantRows(rows);
+            }
+            insertIntoFlattenedTree(move.destinationFlatRow, rows);
+            endInsertRows();
+        }
+    }
+
+    /**
+     * Returns true if index is one of the given rows of parent or one of their descendants.
+     */
+    static bool isInRows(QModelIndex index, const QModelIndex& parent, int first, int last)
+    {
+        for (; index.isValid(); index = index.parent()) {
+            if (index.parent() == parent)
+                return index.row() >= first && index.row() <= last;
+        }
+        return false;
+    }
+
+    /**
+     * Returns true if the layout change only reordered the children of the parents announced in
+     * onLayoutAboutToBeChanged.
+     */
+    bool layoutChangeIsSiblingsReordering() const
+    {
+        for (TreeItemViewModel* parentNode: layoutChangeParents_) {
+            QModelIndex parentIndex = parentNode->sourceIndex();
+            if (parentNode != rootItem_ && !parentIndex.isValid())
+                return false;
+            if (sourceModel()->rowCount(parentIndex) != parentNode->childCount())
+                return false;
+            for (int position = 0; position < parentNode->childCount(); ++position) {
+                QModelIndex childIndex = parentNode->child(position)->sourceIndex();
+                if (!childIndex.isValid() || childIndex.parent() != parentIndex)
+                    return false;
+            }
+        }
+        return true;
+    }
 
-            if (node->hasChildren())
-                flatten(model, index, node);
+    /**
+     * Appends the item and its descendants whose children have been materialized, in depth first order.
+     */
+    void appendMaterializedItems(TreeItemViewModel* item, QList<TreeItemViewModel*>& items) const
+    {
+        if (!item->childrenMaterialized())
+            return;
+        items.append(item);
+        for (int position = 0; position < item->childCount(); ++position)
+            appendMaterializedItems(item->child(position), items);
+    }
+
+    /**
+     * Notifies the change of the hasChildren role of the given item, when its first child is inserted or its last child
+     * is removed.
+     */
+    void notifyHasChildrenChanged(TreeItemViewModel* item)
+    {
+        if (item == nullptr || !item->isRow())
+            return;
+        QModelIndex proxyIndex = index(item->row());
+        emit dataChanged(proxyIndex, proxyIndex, QVector<int>{HasChildren});
+    }
 
-            if (node->isExpanded())
-                node->setExpanded(node->isExpanded());
+    /**
+     * Takes the keys of the children in [from, to) out of the lookup table, they are put back under their new source
+     * index by reinsertShiftedKeys once the source model has been updated.
+     */
+    void takeKeysOfChildren(TreeItemViewModel* parentNode, int from, int to)
+    {
+        for (int position = from; position < to; ++position) {
+            TreeItemViewModel* n = parentNode->child(position);
+            itemsByIndex_.remove(n->sourceIndex());
+            shiftedItems_.append(n);
         }
     }
 
+    void reinsertShiftedKeys()
+    {
+        for (TreeItemViewModel* n: shiftedItems_)
+            itemsByIndex_.insert(n->sourceIndex(), n);
+        shiftedItems_.clear();
+    }
+
+    /**
+     * Creates the items of the children of parentNode, recursively, and appends the items that are rows to the given
+     * list, in flattened tree order.
+     *
+     * In visible rows only mode, the children of a collapsed item are not part of the flattened tree, their items are
+     * only created (materialized) when the item is expanded for the first time, see toggleIsExpanded. Until then,
+     * hasChildren is answered by the source model. This keeps the cost of a reset proportional to the number of
+     * visible items instead of the size of the source tree.
+     *
+     * The expanded state is restored by key (see restoredExpandedKeys_) when the items of the root are created.
+     */
+    void flatten(QAbstractItemModel *model, TreeItemViewModel* parentNode, QList<TreeItemViewModel*>& rows)
+    {
+        QVector<FlattenFrame> frames;
+        pushFlattenFrame(frames, model, parentNode, parentNode == rootItem_ && !restoredExpandedKeys_.isEmpty(),
+                         QString());
+        flattenFrames(model, frames, rows, nullptr, nullptr);
+    }
+
+    /**
+     * Materializes parentNode and pushes the frame of the traversal of its children.
+     */
+    void pushFlattenFrame(QVector<FlattenFrame>& frames, QAbstractItemModel *model, TreeItemViewModel* parentNode,
+                          bool restoresExpandedState, const QString& parentKey)
+    {
+        parentNode->setChildrenMaterialized();
+        FlattenFrame frame;
+        frame.parentNode = parentNode;
+        frame.rowCount = model->rowCount(parentNode->sourceIndex());
+        // a model that fetches its rows lazily may have children that are not counted yet
+        if (frame.rowCount > 0)
+            parentNode->setHasChildren();
+        frame.restoresExpandedState = restoresExpandedState;
+        frame.parentKey = parentKey;
+        frames.append(frame);
+    }
+
+    /**
+     * Runs the depth first traversal of flatten until all the frames are done or, if timer is not null, until the
+     * loading time budget has elapsed (see setLoadingTimeBudget).
+     *
+     * The expanded items are fetched once their children have been created, or appended to deferredFetches if not
+     * null, so that the source model does not insert rows under items whose rows have not been published yet.
+     */
+    void flattenFrames(QAbstractItemModel *model, QVector<FlattenFrame>& frames, QList<TreeItemViewModel*>& rows,
+                       const QElapsedTimer* timer, QList<TreeItemViewModel*>* deferredFetches)
+    {
+        while (!frames.isEmpty()) {
+            FlattenFrame& frame = frames.last();
+            if (frame.nextRow == frame.rowCount) {
+                TreeItemViewModel* node = frame.parentNode;
+                frames.removeLast();
+                // the item of the first frame is fetched by the caller
+                if (!frames.isEmpty() && node->isExpanded()) {
+                    if (deferredFetches != nullptr)
+                        deferredFetches->append(node);
+                    else
+                        scheduleFetch(node);
+                }
+                continue;
+            }
+            if (timer != nullptr && timer->elapsed() >= loadingTimeBudget_)
+                return;
+
+            TreeItemViewModel* parentNode = frame.parentNode;
+            QModelIndex index = model->index(frame.nextRow++, 0, parentNode->sourceIndex());
+
+            // the subtree of the previous root item is reused when the root moves up to one of its ancestors
+            int depth = parentNode->indent() + 1;
+            bool onReusedRootPath = depth < reusedRootPath_.count() && reusedRootPath_[depth] == index;
+            if (onReusedRootPath && depth == reusedRootPath_.count() - 1) {
+                TreeItemViewModel* node = reusedRoot_;
+                reusedRoot_ = nullptr;
+                reusedRootPath_.clear();
+                node->reparent(parentNode);
+                node->setExpanded(true);
+                parentNode->insertChildren(parentNode->childCount(), QList<TreeItemViewModel*>() << node);
+                itemsByIndex_.insert(index, node);
+                if (node->isRow())
+                    rows.append(node);
+                if (node->childrenAreInFlattenedTree())
+                    node->appendDescendantRows(rows);
+                continue;
+            }
+
+            TreeItemViewModel* node = parentNode->addChild(index);
+
+            // the expanded items are restored by key after a reset (see setRestoredExpandedKeys)
+            QString key;
+            bool hasRestoredDescendants = false;
+            // the frame is invalidated by the push of the frame of the item
+            bool restoresExpandedState = frame.restoresExpandedState;
+            if (restoresExpandedState) {
+                key = itemKey(frame.parentKey, index, frame.keyOccurrences);
+                if (restoredExpandedKeys_.contains(key))
+                    node->setExpanded(true);
+                hasRestoredDescendants = restoredAncestorKeys_.contains(key);
+            }
+
+            if (node->isRow())
+                rows.append(node);
+
+            if (!visibleRowsOnly_ || node->isExpanded() || hasRestoredDescendants || onReusedRootPath)
+                pushFlattenFrame(frames, model, node, restoresExpandedState, key);
+        }
+    }
+
+    /**
+     * Inserts a block of items into the flattened tree with a single copy of the tail instead of one insertion per
+     * item.
+     */
+    void insertIntoFlattenedTree(int row, const QList<TreeItemViewModel*>& items)
+    {
+        if (row == flattenedTree_.count()) {
+            flattenedTree_.append(items);
+            return;
+        }
+        QList<TreeItemViewModel*> tail = flattenedTree_.mid(row);
+        flattenedTree_.erase(flattenedTree_.begin() + row, flattenedTree_.end());
+        flattenedTree_.append(items);
+        flattenedTree_.append(tail);
+    }
+
+    /**
+     * Destroys all the items and releases the memory of the item pool at once.
+     */
+    void clearItems()
+    {
+        loadingFrames_.clear();
+        loadingTimer_.stop();
+        flattenedTree_.clear();
+        itemsByIndex_.clear();
+        if (rootItem_ != nullptr) {
+            rootItem_->destroyChildren();
+            itemPool_.destroy(rootItem_);
+            rootItem_ = nullptr;
+        }
+        itemPool_.clear();
+    }
+
     void toggleIsExpanded(int row, bool isExpanded)
     {
-        flattenedTree_[row]->setExpanded(isExpanded);
+        TreeItemViewModel* item = flattenedTree_[row];
+        // the rows built later are appended, the row of the item does not change
+        finishLoadingUnder(item);
+
+        if (!visibleRowsOnly_ || item->isExpanded() == isExpanded) {
+            bool hiddenStateChanged = item->isExpanded() != isExpanded && !item->isHidden();
+            item->setExpanded(isExpanded);
+            // the descendants, whose hidden state changed, span the rows that follow the row of the item
+            int descendantRows = item->subtreeSize() - 1;
+            if (!visibleRowsOnly_ && hiddenStateChanged && descendantRows > 0)
+                emit dataChanged(index(row + 1), index(row + descendantRows), QVector<int>{Hidden});
+        }
+        else if (isExpanded) {
+            if (!item->childrenMaterialized()) {
+                // the children of a collapsed item are not rows yet, they are collected below
+                QList<TreeItemViewModel*> rows;
+                flatten(sourceModel(), item, rows);
+            }
+            QList<TreeItemViewModel*> revealedItems;
+            item->appendDescendantRows(revealedItems);
+            if (!revealedItems.isEmpty())
+                beginInsertRows(QModelIndex(), row + 1, row + revealedItems.count());
+            item->setExpanded(true);
+            if (!revealedItems.isEmpty()) {
+                insertIntoFlattenedTree(row + 1, revealedItems);
+                endInsertRows();
+            }
+        }
+        else {
+            int hiddenRows = item->subtreeSize() - 1;
+            if (hiddenRows > 0)
+                beginRemoveRows(QModelIndex(), row + 1, row + hiddenRows);
+            item->setExpanded(false);
+            if (hiddenRows > 0) {
+                flattenedTree_.erase(flattenedTree_.begin() + row + 1, flattenedTree_.begin() + row + 1 + hiddenRows);
+                endRemoveRows();
+            }
+        }
+
+        QModelIndex proxyIndex = index(row);
+        emit dataChanged(proxyIndex, proxyIndex, QVector<int>{IsExpanded});
+
+        if (isExpanded) {
+            scheduleFetch(item);
+            dispatchFetches();
+        }
+    }
+
+    /**
+     * Sets the expanded state of item and of its descendants (see TreeItemViewModel::setSubtreeExpanded) and notifies
+     * the change with as few signals as possible.
+     */
+    void setSubtreeExpanded(TreeItemViewModel* item, int levels)
+    {
+        if (item == nullptr || sourceModel() == nullptr)
+            return;
+        finishLoading();
+        QList<TreeItemViewModel*> expandedItems;
+        materializeExpandedItems(item, levels, expandedItems);
+
+        if (!visibleRowsOnly_) {
+            // the rows do not change, only the state of the rows of the subtree
+            item->setSubtreeExpanded(levels);
+            int first = std::max(item->row(), 0);
+            int last = item->getLastChildRow();
+            if (last >= first)
+                emit dataChanged(index(first), index(last), QVector<int>{IsExpanded, Hidden});
+        }
+        else if (item == rootItem_) {
+            // the rows change all over the model
+            beginResetModel();
+            item->setSubtreeExpanded(levels);
+            flattenedTree_.clear();
+            rootItem_->appendDescendantRows(flattenedTree_);
+            endResetModel();
+        }
+        else {
+            // the revealed rows are interleaved with the rows that were already visible, the block of the rows of the
+            // descendants is replaced instead of notifying each gap
+            int row = item->row();
+            int oldRows = item->subtreeSize() - 1;
+            if (oldRows > 0) {
+                beginRemoveRows(QModelIndex(), row + 1, row + oldRows);
+                item->setExpanded(false);
+                flattenedTree_.erase(flattenedTree_.begin() + row + 1, flattenedTree_.begin() + row + 1 + oldRows);
+                endRemoveRows();
+            }
+            item->setSubtreeExpanded(levels);
+            QList<TreeItemViewModel*> rows;
+            item->appendDescendantRows(rows);
+            if (!rows.isEmpty()) {
+                beginInsertRows(QModelIndex(), row + 1, row + rows.count());
+                insertIntoFlattenedTree(row + 1, rows);
+                endInsertRows();
+            }
+            emit dataChanged(index(row), index(row), QVector<int>{IsExpanded});
+        }
+
+        for (TreeItemViewModel* expandedItem: expandedItems)
+            scheduleFetch(expandedItem);
+        dispatchFetches();
+    }
+
+    /**
+     * Creates the items of the children of the items that setSubtreeExpanded expands, and appends the expanded items
+     * to expandedItems.
+     */
+    void materializeExpandedItems(TreeItemViewModel* item, int levels, QList<TreeItemViewModel*>& expandedItems)
+    {
+        if (levels == 0)
+            return;
+        if (!item->childrenMaterialized()) {
+            // the children of a collapsed item are not rows yet
+            QList<TreeItemViewModel*> rows;
+            flatten(sourceModel(), item, rows);
+        }
+        expandedItems.append(item);
+        for (int position = 0; position < item->childCount(); ++position)
+            materializeExpandedItems(item->child(position), levels > 0 ? levels - 1 : levels, expandedItems);
     }
 
     void doResetModel(QAbstractItemModel *sourceModel)
     {
         beginResetModel();
-        flatten(sourceModel);
+        rebuildItems(sourceModel);
         endResetModel();
     }
 
-    TreeItemViewModel* findItemByIndex(const QModelIndex &sourceIndex) const
+    /**
+     * Rebuilds the items from the source model, during a reset.
+     *
+     * With a loading time budget, only the first slice of rows is built, the others are appended by loadNextRows.
+     */
+    void rebuildItems(QAbstractItemModel *sourceModel)
+    {
+        bool wasLoading = isLoading();
+        clearItems();
+        rootItem_ = itemPool_.create(&itemContext_, rootIndex_);
+        if (sourceModel != nullptr) {
+            pushFlattenFrame(loadingFrames_, sourceModel, rootItem_, !restoredExpandedKeys_.isEmpty(), QString());
+            QElapsedTimer timer;
+            timer.start();
+            flattenFrames(sourceModel, loadingFrames_, flattenedTree_, loadingTimeBudget_ > 0 ? &timer : nullptr,
+                          nullptr);
+        }
+        updateLoadingState(wasLoading);
+    }
+
+    /**
+     * Builds the next slice of rows and appends them to the flattened tree.
+     */
+    void loadNextRows()
+    {
+        QElapsedTimer timer;
+        timer.start();
+        loadRows(&timer);
+        dispatchFetches();
+    }
+
+    /**
+     * Builds the rows that remain to be built, in a single slice if timer is null.
+     *
+     * The fetches of the expanded items are only queued: they are started by the caller or from the event loop (see
+     * scheduleFetch), not while the source model is in the middle of a change.
+     */
+    void loadRows(const QElapsedTimer* timer)
+    {
+        QList<TreeItemViewModel*> rows;
+        QList<TreeItemViewModel*> fetchedItems;
+        flattenFrames(sourceModel(), loadingFrames_, rows, timer, &fetchedItems);
+        // the rows are built in depth first order, after all the rows built so far
+        if (!rows.isEmpty()) {
+            int first = flattenedTree_.count();
+            beginInsertRows(QModelIndex(), first, first + rows.count() - 1);
+            flattenedTree_.append(rows);
+            endInsertRows();
+        }
+        updateLoadingState(true);
+        for (TreeItemViewModel* item: fetchedItems)
+            scheduleFetch(item);
+    }
+
+    /**
+     * Builds the rows that remain to be built right away, before the tree is changed under an item whose children are
+     * still being built, e.g. from a signal of the source model.
+     */
+    void finishLoading()
+    {
+        if (!isLoading())
+            return;
+        loadingTimer_.stop();
+        loadRows(nullptr);
+    }
+
+    void finishLoadingUnder(const QModelIndex& sourceParent)
+    {
+        finishLoadingUnder(findItemByIndex(sourceParent));
+    }
+
+    void finishLoadingUnder(TreeItemViewModel* item)
+    {
+        for (const FlattenFrame& frame: loadingFrames_) {
+            if (frame.parentNode == item) {
+                finishLoading();
+                return;
+            }
+        }
+    }
+
+    /**
+     * Schedules the next slice of rows if the loading is not done, notifies the changes of the loading state otherwise.
+     */
+    void updateLoadingState(bool wasLoading)
+    {
+        if (isLoading()) {
+            if (!wasLoading)
+                emit loadingChanged();
+            emit loadingProgressChanged();
+            loadingTimer_.start(0);
+            return;
+        }
+        setRestoredExpandedKeys(QSet<QString>());
+        if (wasLoading) {
+            emit loadingChanged();
+            emit loadingProgressChanged();
+        }
+    }
+
+    /**
+     * Sets the keys of the items to expand when the items are next rebuilt by flatten.
+     *
+     * The items of the collapsed ancestors of these items are created too, even when only the visible rows are
+     * exposed, so that the expanded state is applied in the same pass.
+     */
+    void setRestoredExpandedKeys(const QSet<QString>& expandedKeys)
+    {
+        restoredExpandedKeys_ = expandedKeys;
+        restoredAncestorKeys_.clear();
+        for (const QString& key: expandedKeys) {
+            // the separators that are escaped in the values of the key role (see escapedKeyValue) are skipped
+            for (int i = 1; i < key.length(); ++i) {
+                if (key[i] == QLatin1Char('\\'))
+                    ++i;
+                else if (key[i] == QLatin1Char('/'))
+                    restoredAncestorKeys_.insert(key.left(i));
+            }
+        }
+    }
+
+    /**
+     * Returns the key of the item at the given source index, i.e. the path of the values of the key role (see
+     * setKeyRole) from the top level item.
+     *
+     * Siblings that have the same value are told apart by their occurrence number, counted in occurrences. The
+     * separators that appear in the values are escaped (see escapedKeyValue) so that distinct items never share a key.
+     */
+    QString itemKey(const QString& parentKey, const QModelIndex& index, QHash<QString, int>& occurrences) const
+    {
+        QString text = index.data(keyRole_).toString();
+        int occurrence = occurrences[text]++;
+        QString key = parentKey + QLatin1Char('/') + escapedKeyValue(text);
+        if (occurrence > 0)
+            key += QLatin1Char('#') + QString::number(occurrence);
+        return key;
+    }
+
+    /**
+     * Escapes, with a backslash, the path separator '/', the occurrence separator '#' and the backslash itself in a
+     * value of the key role.
+     */
+    static QString escapedKeyValue(QString value)
+    {
+        value.replace(QLatin1Char('\\'), QLatin1String("\\\\"));
+        value.replace(QLatin1Char('/'), QLatin1String("\\/"));
+        value.replace(QLatin1Char('#'), QLatin1String("\\#"));
+        return value;
+    }
+
+    /**
+     * Appends the keys of the descendants of item that are rows, in flattened tree order, and the keys of the expanded
+     * descendants to expandedKeys (if not null).
+     */
+    void appendItemKeys(TreeItemViewModel* item, const QString& key, QStringList* rowKeys,
+                        QSet<QString>* expandedKeys) const
+    {
+        QHash<QString, int> occurrences;
+        for (int position = 0; position < item->childCount(); ++position) {
+            TreeItemViewModel* child = item->child(position);
+            QString childKey = itemKey(key, child->sourceIndex(), occurrences);
+            if (rowKeys != nullptr && child->isRow())
+                rowKeys->append(childKey);
+            if (expandedKeys != nullptr && child->isExpanded())
+                expandedKeys->insert(childKey);
+            appendItemKeys(child, childKey, rowKeys, expandedKeys);
+        }
+    }
+
+    /**
+     * Records the keys of the rows and of the expanded items, while the source indexes of the items are still valid.
+     */
+    void takeResetSnapshot()
+    {
+        resetSnapshotRowKeys_.clear();
+        // the keys that the loading has not applied yet are kept (see setLoadingTimeBudget)
+        resetSnapshotExpandedKeys_ = restoredExpandedKeys_;
+        if (rootItem_ != nullptr)
+            appendItemKeys(rootItem_, QString(), &resetSnapshotRowKeys_, &resetSnapshotExpandedKeys_);
+    }
+
+    /**
+     * Rebuilds the items from the source model and turns the rows recorded by takeResetSnapshot into the new ones with
+     * the minimal set of row removals, moves and insertions, the longest common subsequence of the old and new keys
+     * being kept in place.
+     *
+     * The rows that are kept are replaced by their new item first, so that their data is valid while the signals are
+     * emitted. mapFromSource is only consistent again once the diff has been applied.
+     */
+    void applyResetDiff()
+    {
+        QStringList oldKeys = resetSnapshotRowKeys_;
+        TreeItemViewModel* oldRoot = rootItem_;
+        resetSnapshotRowKeys_.clear();
+        // the rows that were still loading are built along with the others, the diff is computed from a complete tree
+        bool wasLoading = isLoading();
+        loadingFrames_.clear();
+        loadingTimer_.stop();
+
+        // the expanded state is restored by key, the source indexes of the old items are no longer valid
+        itemsByIndex_.clear();
+        expandedIndexes_.clear();
+        rootItem_ = itemPool_.create(&itemContext_, rootIndex_);
+        QList<TreeItemViewModel*> newRows;
+        setRestoredExpandedKeys(resetSnapshotExpandedKeys_);
+        resetSnapshotExpandedKeys_.clear();
+        if (sourceModel() != nullptr)
+            flatten(sourceModel(), rootItem_, newRows);
+        updateLoadingState(wasLoading);
+        QStringList newKeys;
+        appendItemKeys(rootItem_, QString(), &newKeys, nullptr);
+
+        QHash<QString, int> newRowByKey;
+        for (int row = 0; row < newKeys.count(); ++row)
+            newRowByKey.insert(newKeys[row], row);
+        QSet<QString> oldKeySet = QSet<QString>::fromList(oldKeys);
+
+        // the rows are matched by key, they cannot be if two rows share a key
+        QList<QPair<int, int>> matches;
+        if (newRowByKey.count() != newKeys.count() || oldKeySet.count() != oldKeys.count() ||
+            !longestCommonSubsequence(oldKeys, newKeys, maxResetDiffDifferences, matches)) {
+            beginResetModel();
+            flattenedTree_ = newRows;
+            destroyItems(oldRoot);
+            endResetModel();
+            return;
+        }
+
+        QVector<bool> keptInPlace(newKeys.count(), false);
+        for (const QPair<int, int>& match: matches)
+            keptInPlace[match.second] = true;
+
+        QStringList keys = oldKeys;
+        for (int row = 0; row < oldKeys.count(); ++row) {
+            if (newRowByKey.contains(oldKeys[row]))
+                flattenedTree_[row] = newRows[newRowByKey.value(oldKeys[row])];
+        }
+
+        // remove the rows that no longer exist, one range at a time, from the bottom
+        for (int row = oldKeys.count() - 1; row >= 0; ) {
+            if (newRowByKey.contains(oldKeys[row])) {
+                --row;
+                continue;
+            }
+            int last = row;
+            while (row >= 0 && !newRowByKey.contains(oldKeys[row]))
+                --row;
+            int first = row + 1;
+            beginRemoveRows(QModelIndex(), first, last);
+            flattenedTree_.erase(flattenedTree_.begin() + first, flattenedTree_.begin() + last + 1);
+            keys.erase(keys.begin() + first, keys.begin() + last + 1);
+            endRemoveRows();
+        }
+
+        // move the rows that are not part of the common subsequence right after the row that precedes them in the new
+        // order, in new order; the rows that follow each other in both orders (e.g. the rows of a moved subtree) are
+        // moved as a single range
+        QHash<QString, int> positionByKey;
+        for (int position = 0; position < keys.count(); ++position)
+            positionByKey.insert(keys[position], position);
+        QString anchorKey;
+        for (int row = 0; row < newKeys.count(); ) {
+            const QString& key = newKeys[row];
+            if (!oldKeySet.contains(key)) {
+                ++row;
+                continue;
+            }
+            if (keptInPlace[row]) {
+                anchorKey = key;
+                ++row;
+                continue;
+            }
+            int from = positionByKey.value(key);
+            int count = 1;
+            while (row + count < newKeys.count() && !keptInPlace[row + count] && from + count < keys.count() &&
+                   keys[from + count] == newKeys[row + count])
+                ++count;
+            int last = from + count - 1;
+            int to = anchorKey.isNull() ? 0 : positionByKey.value(anchorKey) + 1;
+            if (from != to) {
+                beginMoveRows(QModelIndex(), from, last, QModelIndex(), to);
+                int first = std::min(from, to);
+                int end = std::max(last + 1, to);
+                if (from < to) {
+                    std::rotate(flattenedTree_.begin() + from, flattenedTree_.begin() + last + 1,
+                                flattenedTree_.begin() + to);
+                    std::rotate(keys.begin() + from, keys.begin() + last + 1, keys.begin() + to);
+                }
+                else {
+                    std::rotate(flattenedTree_.begin() + to, flattenedTree_.begin() + from,
+                                flattenedTree_.begin() + last + 1);
+                    std::rotate(keys.begin() + to, keys.begin() + from, keys.begin() + last + 1);
+                }
+                // only the positions of the rows between the source and the destination of the range have changed
+                for (int position = first; position < end; ++position)
+                    positionByKey[keys[position]] = position;
+                endMoveRows();
+            }
+            anchorKey = newKeys[row + count - 1];
+            row += count;
+        }
+
+        // insert the new rows, one range at a time
+        for (int row = 0; row < newKeys.count(); ) {
+            if (oldKeySet.contains(newKeys[row])) {
+                ++row;
+                continue;
+            }
+            int first = row;
+            while (row < newKeys.count() && !oldKeySet.contains(newKeys[row]))
+                ++row;
+            beginInsertRows(QModelIndex(), first, row - 1);
+            insertIntoFlattenedTree(first, newRows.mid(first, row - first));
+            endInsertRows();
+        }
+
+        Q_ASSERT(flattenedTree_ == newRows);
+        destroyItems(oldRoot);
+
+        // the data of the rows that are kept may have changed, each contiguous span of them is notified with the roles
+        // that can change, the inserted rows are not
+        QVector<int> roles{Indentation, HasChildren, IsExpanded, Hidden};
+        if (sourceModel() != nullptr) {
+            for (int role: sourceModel()->roleNames().keys())
+                roles.append(role);
+        }
+        for (int row = 0; row < newKeys.count(); ) {
+            if (!oldKeySet.contains(newKeys[row])) {
+                ++row;
+                continue;
+            }
+            int first = row;
+            while (row < newKeys.count() && oldKeySet.contains(newKeys[row]))
+                ++row;
+            emit dataChanged(index(first), index(row - 1), roles);
+        }
+    }
+
+    /**
+     * Queues the fetch of the children of item if the source model has more to fetch (see setMaxFetchesInFlight).
+     *
+     * The queued fetches are started by dispatchFetches, right away at the end of the change that expanded the items or
+     * from the event loop.
+     */
+    void scheduleFetch(TreeItemViewModel* item)
+    {
+        QModelIndex sourceIndex = item->sourceIndex();
+        if (!sourceModel()->canFetchMore(sourceIndex) || pendingFetches_.contains(sourceIndex))
+            return;
+        for (const Fetch& fetch: fetchesInFlight_) {
+            if (fetch.index == sourceIndex)
+                return;
+        }
+        pendingFetches_.append(sourceIndex);
+        // the timer may be waiting for the expiry of a fetch in flight, dispatchFetches schedules it again
+        fetchTimer_.start(0);
+    }
+
+    /**
+     * Starts the queued fetches while fewer than maxFetchesInFlight are in flight, closest to the visible range first,
+     * and schedules the expiry of the fetches in flight.
+     */
+    void dispatchFetches()
+    {
+        fetchTimer_.stop();
+        qint64 now = fetchClock_.elapsed();
+        for (int i = fetchesInFlight_.count() - 1; i >= 0; --i) {
+            if (!fetchesInFlight_[i].index.isValid() || now - fetchesInFlight_[i].startTime >= fetchTimeout_) {
+                fetchesInFlight_.removeAt(i);
+                // a reveal request may wait for this fetch (e.g. of an empty directory)
+                if (!revealRequests_.isEmpty())
+                    revealTimer_.start(0);
+            }
+        }
+
+        while (!pendingFetches_.isEmpty() &&
+               (maxFetchesInFlight_ == 0 || fetchesInFlight_.count() < maxFetchesInFlight_)) {
+            int next = -1;
+            int nextDistance = INT_MAX;
+            for (int i = pendingFetches_.count() - 1; i >= 0; --i) {
+                // the fetches of the items that have been collapsed or removed since they were queued are dropped
+                TreeItemViewModel* item = findItemByIndex(pendingFetches_[i]);
+                if (!pendingFetches_[i].isValid() || item == nullptr || !item->isExpanded() ||
+                    !sourceModel()->canFetchMore(pendingFetches_[i])) {
+                    pendingFetches_.removeAt(i);
+                    if (next > i)
+                        --next;
+                    continue;
+                }
+                int distance = distanceToVisibleRange(item);
+                if (distance <= nextDistance) {
+                    next = i;
+                    nextDistance = distance;
+                }
+            }
+            if (next == -1)
+                break;
+            startFetch(pendingFetches_.takeAt(next), now);
+        }
+
+        // the prefetches come after the fetches of the expanded items, the budget is checked again before each one as
+        // the previous ones may have loaded their rows already
+        while (pendingFetches_.isEmpty() && !pendingPrefetches_.isEmpty() &&
+               (maxFetchesInFlight_ == 0 || fetchesInFlight_.count() < maxFetchesInFlight_)) {
+            if (countPrefetchedRows() >= prefetchBudget_) {
+                pendingPrefetches_.clear();
+                break;
+            }
+            QPersistentModelIndex sourceIndex = pendingPrefetches_.takeFirst();
+            if (!sourceIndex.isValid() || !sourceModel()->canFetchMore(sourceIndex))
+                continue;
+            prefetchedIndexes_.insert(sourceIndex);
+            startFetch(sourceIndex, now);
+        }
+
+        if (!fetchesInFlight_.isEmpty()) {
+            qint64 firstExpiry = fetchesInFlight_.first().startTime + fetchTimeout_;
+            fetchTimer_.start(static_cast<int>(std::max<qint64>(firstExpiry - fetchClock_.elapsed(), 0)));
+        }
+    }
+
+    void startFetch(const QPersistentModelIndex& sourceIndex, qint64 now)
+    {
+        fetchesInFlight_.append(Fetch{sourceIndex, now});
+        // a source model that fetches synchronously completes the fetch before fetchMore returns
+        sourceModel()->fetchMore(sourceIndex);
+    }
+
+    /**
+     * Ends the fetch of the children of the given source index, when the source model inserts them.
+     */
+    void completeFetch(const QModelIndex& sourceIndex)
+    {
+        for (int i = 0; i < fetchesInFlight_.count(); ++i) {
+            if (fetchesInFlight_[i].index == sourceIndex) {
+                fetchesInFlight_.removeAt(i);
+                // the next fetch is not started from the signal of the source model
+                if (!pendingFetches_.isEmpty() || !pendingPrefetches_.isEmpty())
+                    fetchTimer_.start(0);
+                // the next level can be prefetched once the children are loaded
+                if (prefetchDepth_ > 1 && prefetchedIndexes_.contains(sourceIndex))
+                    prefetchTimer_.start(prefetchDelay);
+                return;
+            }
+        }
+    }
+
+    /**
+     * Queues the prefetch of the descendants of the visible collapsed items (see setPrefetchDepth).
+     */
+    void prefetchVisibleItems()
+    {
+        pendingPrefetches_.clear();
+        if (prefetchDepth_ == 0 || sourceModel() == nullptr || countPrefetchedRows() >= prefetchBudget_)
+            return;
+
+        int lastRow = std::min(visibleLastRow_, flattenedTree_.count() - 1);
+        for (int row = std::max(visibleFirstRow_, 0); row <= lastRow; ++row) {
+            TreeItemViewModel* item = flattenedTree_[row];
+            if (!item->isExpanded())
+                appendPrefetches(item->sourceIndex(), prefetchDepth_);
+        }
+        dispatchFetches();
+    }
+
+    /**
+     * Returns the number of rows loaded by the prefetch, the items that have been expanded since are no longer
+     * counted as prefetched.
+     */
+    int countPrefetchedRows()
+    {
+        int prefetchedRows = 0;
+        for (const QPersistentModelIndex& sourceIndex: prefetchedIndexes_.values()) {
+            TreeItemViewModel* item = findItemByIndex(sourceIndex);
+            if (item != nullptr && item->isExpanded())
+                prefetchedIndexes_.remove(sourceIndex);
+            else
+                prefetchedRows += sourceModel()->rowCount(sourceIndex);
+        }
+        return prefetchedRows;
+    }
+
+    /**
+     * Appends the source index to the queued prefetches if its children remain to be fetched, or its descendants
+     * down to the given depth if they have been fetched already.
+     */
+    void appendPrefetches(const QModelIndex& sourceIndex, int depth)
+    {
+        if (depth == 0)
+            return;
+        if (sourceModel()->canFetchMore(sourceIndex)) {
+            pendingPrefetches_.append(sourceIndex);
+            return;
+        }
+        int rowCount = sourceModel()->rowCount(sourceIndex);
+        for (int row = 0; row < rowCount; ++row)
+            appendPrefetches(sourceModel()->index(row, 0, sourceIndex), depth - 1);
+    }
+
+    /**
+     * Returns the number of rows between the row of item and the visible range (see setVisibleRange), INT_MAX if the
+     * item is not a row.
+     */
+    int distanceToVisibleRange(TreeItemViewModel* item) const
+    {
+        if (!item->isRow())
+            return INT_MAX;
+        int row = item->row();
+        if (row < visibleFirstRow_)
+            return visibleFirstRow_ - row;
+        if (row > visibleLastRow_)
+            return row - visibleLastRow_;
+        return 0;
+    }
+
+    /**
+     * Returns whether the fetch of the children of the given source index is queued or in flight.
+     */
+    bool isFetching(const QModelIndex& sourceIndex) const
+    {
+        if (pendingFetches_.contains(sourceIndex))
+            return true;
+        for (const Fetch& fetch: fetchesInFlight_) {
+            if (fetch.index == sourceIndex)
+                return true;
+        }
+        return false;
+    }
+
+    QFuture<int> startRevealRequest(const QStringList& path, bool expandItem, int timeout, const QJSValue& callback)
     {
-        for (TreeItemViewModel* n: flattenedTree_) {
-            if (n->sourceIndex() == sourceIndex)
-                return n;
+        RevealRequest request;
+        request.path = path;
+        request.expandItem = expandItem;
+        request.item = rootIndex_;
+        request.deadline = fetchClock_.elapsed() + timeout;
+        request.callback = callback;
+        request.result.reportStarted();
+        QFuture<int> future = request.result.future();
+        revealRequests_.append(request);
+        advanceRevealRequests();
+        return future;
+    }
+
+    /**
+     * Advances the reveal requests as far as the loaded rows allow, they are advanced again when rows are inserted under
+     * their item or when a fetch ends, until they are resolved or time out.
+     */
+    void advanceRevealRequests()
+    {
+        revealTimer_.stop();
+        if (revealRequests_.isEmpty())
+            return;
+        finishLoading();
+
+        // the callbacks may start new requests
+        QList<RevealRequest> requests;
+        requests.swap(revealRequests_);
+        for (RevealRequest& request: requests) {
+            int row = -1;
+            if (request.result.isCanceled()) {
+                request.result.reportFinished();
+                continue;
+            }
+            if (advanceRevealRequest(request, row) || fetchClock_.elapsed() >= request.deadline)
+                finishRevealRequest(request, row);
+            else
+                revealRequests_.append(request);
+        }
+
+        if (!revealRequests_.isEmpty()) {
+            qint64 firstDeadline = revealRequests_.first().deadline;
+            for (const RevealRequest& request: revealRequests_)
+                firstDeadline = std::min(firstDeadline, request.deadline);
+            revealTimer_.start(static_cast<int>(std::max<qint64>(firstDeadline - fetchClock_.elapsed(), 0)));
         }
-        return nullptr;
     }
 
+    /**
+     * Expands the items of the path of the request, down from the deepest one found so far, as long as their children
+     * are loaded.
+     *
+     * A source model may insert the children of an item in several batches (e.g. QFileSystemModel for a large
+     * directory) or take longer than fetchTimeout to insert the first ones, so a request whose next item is not among
+     * the children loaded so far waits for the next rows inserted under its item, until its deadline.
+     *
+     * @return true if the request is resolved, with the row of its item or -1 if its item has been removed, false if it
+     * waits for rows to be inserted.
+     */
+    bool advanceRevealRequest(RevealRequest& request, int& row)
+    {
+        while (true) {
+            TreeItemViewModel* item = findItemByIndex(request.item);
+            // the item has been removed, or it is not in the tree of the root item any more
+            if (sourceModel() == nullptr || item == nullptr || (request.depth > 0 && !request.item.isValid()))
+                return true;
+            if (item != rootItem_) {
+                // an ancestor that the request has already passed may have been collapsed since
+                expandAncestors(item);
+                if (!item->isRow())
+                    return true;
+            }
+            bool isTarget = request.depth == request.path.count();
+            if (isTarget && !request.expandItem) {
+                row = item->row();
+                return true;
+            }
+
+            if (item != rootItem_ && !item->isExpanded())
+                setData(index(item->row()), true, IsExpanded);
+            if (sourceModel()->canFetchMore(request.item)) {
+                scheduleFetch(item);
+                dispatchFetches();
+            }
+            if (isFetching(request.item))
+                return false;
+            if (isTarget) {
+                row = item->row();
+                return true;
+            }
+
+            QModelIndex child;
+            int rowCount = sourceModel()->rowCount(request.item);
+            for (int childRow = 0; childRow < rowCount && !child.isValid(); ++childRow) {
+                QModelIndex childIndex = sourceModel()->index(childRow, 0, request.item);
+                if (childIndex.data(keyRole_).toString() == request.path[request.depth])
+                    child = childIndex;
+            }
+            if (!child.isValid())
+                return false;
+            request.item = child;
+            ++request.depth;
+        }
+    }
+
+    /**
+     * Expands the collapsed ancestors of item, from the top level one down, so that the item is a visible row.
+     */
+    void expandAncestors(TreeItemViewModel* item)
+    {
+        QList<TreeItemViewModel*> collapsedAncestors;
+        for (TreeItemViewModel* ancestor = item->parent(); ancestor != rootItem_; ancestor = ancestor->parent()) {
+            if (!ancestor->isExpanded())
+                collapsedAncestors.prepend(ancestor);
+        }
+        // each ancestor is a row once the ones above it are expanded
+        for (TreeItemViewModel* ancestor: collapsedAncestors)
+            setData(index(ancestor->row()), true, IsExpanded);
+    }
+
+    void finishRevealRequest(RevealRequest& request, int row)
+    {
+        request.result.reportResult(row);
+        request.result.reportFinished();
+        if (request.callback.isCallable())
+            request.callback.call(QList<QJSValue>{QJSValue(row)});
+    }
+
+    /**
+     * Resolves the proxy models between the source model and the model at the bottom of the chain.
+     *
+     * The items map the source indexes through the chain to store their expanded state, the chain is resolved again
+     * when one of its models changes its source model.
+     */
+    void updateProxyChain()
+    {
+        for (const QMetaObject::Connection& connection: proxyChainConnections_)
+            disconnect(connection);
+        proxyChainConnections_.clear();
+        proxyChain_.clear();
+
+        // the expanded indexes are shifted by the changes of the model at the bottom of the chain, which are seen
+        // through the models above it, the prefetched indexes by the changes of the source model
+        QList<const QAbstractItemModel*> models;
+        if (sourceModel() != nullptr)
+            models.append(sourceModel());
+        QAbstractProxyModel* proxyModel = qobject_cast<QAbstractProxyModel*>(sourceModel());
+        while (proxyModel != nullptr) {
+            proxyChain_.append(proxyModel);
+            proxyChainConnections_.append(connect(proxyModel, &QAbstractProxyModel::sourceModelChanged, this,
+                                                  &TreeViewModel::updateProxyChain));
+            if (proxyModel->sourceModel() != nullptr)
+                models.append(proxyModel->sourceModel());
+            proxyModel = qobject_cast<QAbstractProxyModel*>(proxyModel->sourceModel());
+        }
+        expandedIndexes_.setModels(models);
+        prefetchedIndexes_.setModels(models.mid(0, 1));
+    }
+
+    /**
+     * Destroys a tree of items that is no longer used, without releasing the memory of the item pool.
+     */
+    void destroyItems(TreeItemViewModel* root)
+    {
+        if (root == nullptr)
+            return;
+        root->destroyChildren();
+        itemPool_.destroy(root);
+    }
+
+    TreeItemViewModel* findItemByIndex(const QModelIndex &sourceIndex) const
+    {
+        // the root item is not in the lookup table (see TreeItemViewModel::TreeItemViewModel)
+        if (sourceIndex == rootIndex_)
+            return rootItem_;
+        return itemsByIndex_.value(sourceIndex, nullptr);
+    }
+
+    /**
+     * Returns the item at the given source index if the items of its children have been created, nullptr otherwise.
+     */
+    TreeItemViewModel* findMaterializedItem(const QModelIndex &sourceIndex) const
+    {
+        TreeItemViewModel* item = findItemByIndex(sourceIndex);
+        if (item == nullptr || !item->childrenMaterialized())
+            return nullptr;
+        return item;
+    }
+
+    ItemPool<TreeItemViewModel> itemPool_;
     QList<TreeItemViewModel*> flattenedTree_;
-    QMap<QModelIndex, bool> expandedMap_;
-    QMap<QModelIndex, bool> hiddenMap;
-//    TreeItemViewModel* rootItem_ = nullptr;
+    // source index -> item lookup table, keyed by the current (non persistent) source index so that
+    // the keys of the siblings that are shifted by an insertion have to be updated (see onRowsAboutToBeInserted)
+    QHash<QModelIndex, TreeItemViewModel*> itemsByIndex_;
+    QList<TreeItemViewModel*> shiftedItems_;
+    // removal announced by the source model in rowsAboutToBeRemoved and applied in rowsRemoved
+    struct PendingRemoval
+    {
+        TreeItemViewModel* parentNode = nullptr;
+        int first = 0;
+        int last = 0;
+        int firstRow = 0;
+        int rowCount = 0;
+    } pendingRemoval_;
+    // move announced by the source model in rowsAboutToBeMoved and applied in rowsMoved
+    struct PendingMove
+    {
+        enum Kind { None, Move, Removal, Insertion } kind = None;
+        TreeItemViewModel* sourceNode = nullptr;
+        TreeItemViewModel* destinationNode = nullptr;
+        int start = 0;
+        int end = 0;
+        int destinationRow = 0;
+        // whether the moved subtrees are part of the flattened tree before and after the move
+        bool sourceRows = false;
+        bool destinationRows = false;
+        bool orderChanged = false;
+        int firstRow = 0;
+        int rowCount = 0;
+        int destinationFlatRow = 0;
+    } pendingMove_;
+    // sibling groups reordered by the layout change of the source model and persistent indexes to remap
+    QList<TreeItemViewModel*> layoutChangeParents_;
+    QModelIndexList layoutChangePersistentIndexes_;
+    QList<TreeItemViewModel*> layoutChangePersistentItems_;
+    // proxy models below this model, resolved when a model of the chain changes its source (see updateProxyChain)
+    QList<QAbstractProxyModel*> proxyChain_;
+    QList<QMetaObject::Connection> proxyChainConnections_;
+    // persistent indexes of the expanded items in the model at the bottom of the proxy chain
+    PersistentIndexSet expandedIndexes_;
+    bool visibleRowsOnly_ = false;
+    bool diffOnReset_ = false;
+    // beyond this number of differences, a reset of the source model resets the model even if diffOnReset is set
+    static const int maxResetDiffDifferences = 1000;
+    QStringList resetSnapshotRowKeys_;
+    QSet<QString> resetSnapshotExpandedKeys_;
+    // keys of the items to expand and of their ancestors while the items are rebuilt (see setRestoredExpandedKeys)
+    QSet<QString> restoredExpandedKeys_;
+    QSet<QString> restoredAncestorKeys_;
+    int keyRole_ = Qt::DisplayRole;
+    // state shared by all the items, declared after the members it refers to
+    TreeItemViewModelContext itemContext_;
+    // invisible item whose children are the top level items, and its source index (see setRootIndex)
+    TreeItemViewModel* rootItem_ = nullptr;
+    QPersistentModelIndex rootIndex_;
+    // previous root item grafted by flatten when the root moves up, and the path from the new root to its index
+    TreeItemViewModel* reusedRoot_ = nullptr;
+    QModelIndexList reusedRootPath_;
+    bool rootRemoved_ = false;
+    // traversal suspended between two slices of rows and the timer that resumes it (see setLoadingTimeBudget)
+    QVector<FlattenFrame> loadingFrames_;
+    QTimer loadingTimer_;
+    int loadingTimeBudget_ = 0;
+    // fetches of the source model that are queued and in flight (see setMaxFetchesInFlight)
+    struct Fetch
+    {
+        QPersistentModelIndex index;
+        qint64 startTime;
+    };
+    QList<QPersistentModelIndex> pendingFetches_;
+    QList<Fetch> fetchesInFlight_;
+    QTimer fetchTimer_;
+    QElapsedTimer fetchClock_;
+    int maxFetchesInFlight_ = 4;
+    // beyond this time in milliseconds, a fetch that did not insert any row is no longer counted as in flight
+    int fetchTimeout_ = 1000;
+    int visibleFirstRow_ = 0;
+    int visibleLastRow_ = INT_MAX;
+    // source indexes whose children are fetched in advance and the ones that have been (see setPrefetchDepth)
+    QList<QPersistentModelIndex> pendingPrefetches_;
+    PersistentIndexSet prefetchedIndexes_;
+    QTimer prefetchTimer_;
+    int prefetchDepth_ = 0;
+    int prefetchBudget_ = 10000;
+    // time in milliseconds during which the visible range has to be stable before the prefetch starts
+    static const int prefetchDelay = 200;
+    // pending revealPath and expandPath calls, advanced when rows are inserted or a fetch ends
+    QList<RevealRequest> revealRequests_;
+    QTimer revealTimer_;
 };
 
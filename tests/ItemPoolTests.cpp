@@ -0,0 +1,68 @@
+#include <ItemPool.h>
+#include "catch.hpp"
+
+namespace {
+    struct Counted
+    {
+        explicit Counted(int value): value(value) { ++alive; }
+        ~Counted() { --alive; }
+
+        int value;
+        static int alive;
+    };
+
+    int Counted::alive = 0;
+}
+
+SCENARIO("ItemPool allocates items in slabs and reuses the slots of destroyed items")
+{
+    GIVEN("An empty item pool") {
+        Counted::alive = 0;
+        ItemPool<Counted> pool(128);
+
+        REQUIRE(pool.size() == 0);
+        REQUIRE(pool.slabCount() == 0);
+
+        WHEN("many items are created") {
+            QList<Counted*> items;
+            for (int i = 0; i < 1000; ++i)
+                items.append(pool.create(i));
+
+            THEN("they are constructed with their arguments") {
+                REQUIRE(Counted::alive == 1000);
+                REQUIRE(items.first()->value == 0);
+                REQUIRE(items.last()->value == 999);
+            }
+
+            AND_THEN("they are allocated in a few growing slabs") {
+                REQUIRE(pool.size() == 1000);
+                // 64 + 128 * 8 slots
+                REQUIRE(pool.slabCount() == 9);
+            }
+
+            AND_WHEN("an item is destroyed and another one is created") {
+                Counted* destroyed = items[10];
+                pool.destroy(destroyed);
+                Counted* created = pool.create(-1);
+
+                THEN("the slot of the destroyed item is reused") {
+                    REQUIRE(created == destroyed);
+                    REQUIRE(pool.size() == 1000);
+                    REQUIRE(pool.slabCount() == 9);
+                }
+            }
+
+            AND_WHEN("all items are destroyed and the pool is cleared") {
+                for (Counted* item: items)
+                    pool.destroy(item);
+                pool.clear();
+
+                THEN("the slabs are released") {
+                    REQUIRE(Counted::alive == 0);
+                    REQUIRE(pool.size() == 0);
+                    REQUIRE(pool.slabCount() == 0);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#include <QtGui/QStandardItemModel>
+#include <QtCore/QIdentityProxyModel>
+#include <PersistentIndexSet.h>
+#include "catch.hpp"
+
+SCENARIO("PersistentIndexSet finds its indexes after the rows of their model change")
+{
+    GIVEN("A set that holds the index of the third of four rows") {
+        QStandardItemModel model;
+        for (int row = 0; row < 4; ++row)
+            model.appendRow(new QStandardItem(QString("Item %1").arg(row)));
+        PersistentIndexSet indexes;
+        indexes.setModels({&model});
+        indexes.insert(model.index(2, 0));
+
+        REQUIRE(indexes.contains(model.index(2, 0)));
+        REQUIRE(!indexes.contains(model.index(1, 0)));
+
+        WHEN("rows are inserted before it") {
+            model.insertRow(0, new QStandardItem("New item 1"));
+            model.insertRow(0, new QStandardItem("New item 2"));
+
+            THEN("it is found at its new row") {
+                REQUIRE(indexes.contains(model.index(4, 0)));
+                REQUIRE(!indexes.contains(model.index(2, 0)));
+            }
+
+            AND_WHEN("it is removed from the set") {
+                indexes.remove(model.index(4, 0));
+
+                THEN("the set is empty") {
+                    REQUIRE(indexes.isEmpty());
+                }
+            }
+        }
+
+        WHEN("its row is removed") {
+            model.removeRow(2);
+
+            THEN("it is dropped from the set") {
+                REQUIRE(indexes.count() == 0);
+                REQUIRE(!indexes.contains(model.index(2, 0)));
+            }
+        }
+    }
+
+    GIVEN("A set that holds the index of a source model, seen through a proxy model") {
+        QStandardItemModel model;
+        for (int row = 0; row < 4; ++row)
+            model.appendRow(new QStandardItem(QString("Item %1").arg(row)));
+        QIdentityProxyModel proxyModel;
+        proxyModel.setSourceModel(&model);
+        PersistentIndexSet indexes;
+        indexes.setModels({&proxyModel, &model});
+        indexes.insert(model.index(2, 0));
+
+        WHEN("a row is inserted before it, the set being looked up when the proxy model notifies the insertion") {
+            bool found = false;
+            QObject::connect(&proxyModel, &QAbstractItemModel::rowsInserted, [&] {
+                found = indexes.contains(model.index(3, 0));
+            });
+            model.insertRow(0, new QStandardItem("New item"));
+
+            THEN("it is found at its new row") {
+                REQUIRE(found);
+            }
+        }
+    }
+}
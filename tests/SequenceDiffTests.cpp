@@ -0,0 +1,78 @@
+#include <SequenceDiff.h>
+#include <QtCore/QStringList>
+#include "catch.hpp"
+
+namespace {
+    QString commonElements(const QStringList& a, const QList<QPair<int, int>>& matches)
+    {
+        QString result;
+        for (const QPair<int, int>& match: matches)
+            result += a[match.first];
+        return result;
+    }
+}
+
+SCENARIO("longestCommonSubsequence finds the elements two sequences have in common, in order")
+{
+    GIVEN("Two sequences") {
+        QStringList a = QString("A,B,C,A,B,B,A").split(",");
+        QStringList b = QString("C,B,A,B,A,C").split(",");
+
+        WHEN("their longest common subsequence is computed") {
+            QList<QPair<int, int>> matches;
+            bool found = longestCommonSubsequence(a, b, 100, matches);
+
+            THEN("it is found and has the expected length") {
+                REQUIRE(found);
+                REQUIRE(matches.count() == 4);
+            }
+
+            AND_THEN("the matches are equal elements in increasing order") {
+                for (int i = 0; i < matches.count(); ++i) {
+                    REQUIRE(a[matches[i].first] == b[matches[i].second]);
+                    if (i > 0) {
+                        REQUIRE(matches[i].first > matches[i - 1].first);
+                        REQUIRE(matches[i].second > matches[i - 1].second);
+                    }
+                }
+            }
+        }
+
+        WHEN("the number of differences exceeds the limit") {
+            QList<QPair<int, int>> matches;
+            bool found = longestCommonSubsequence(a, b, 2, matches);
+
+            THEN("the search is abandoned") {
+                REQUIRE(!found);
+                REQUIRE(matches.isEmpty());
+            }
+        }
+    }
+
+    GIVEN("A sequence and a copy of it where an element has been moved") {
+        QStringList a = QString("M,A,B,C").split(",");
+        QStringList b = QString("A,B,C,M").split(",");
+
+        WHEN("their longest common subsequence is computed") {
+            QList<QPair<int, int>> matches;
+            longestCommonSubsequence(a, b, 100, matches);
+
+            THEN("only the moved element is not matched") {
+                REQUIRE(commonElements(a, matches).toStdString() == "ABC");
+            }
+        }
+    }
+
+    GIVEN("Empty sequences") {
+        QStringList empty;
+        QStringList b = QString("A,B").split(",");
+
+        THEN("they have nothing in common") {
+            QList<QPair<int, int>> matches;
+            REQUIRE(longestCommonSubsequence(empty, b, 100, matches));
+            REQUIRE(longestCommonSubsequence(b, empty, 100, matches));
+            REQUIRE(longestCommonSubsequence(empty, empty, 0, matches));
+            REQUIRE(matches.isEmpty());
+        }
+    }
+}
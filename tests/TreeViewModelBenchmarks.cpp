@@ -0,0 +1,254 @@
+#include <QtGui/QStandardItemModel>
+#include <TreeViewModel.h>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include "catch.hpp"
+
+/**
+ * Counts the heap allocations (and the bytes requested) made by the process so that the benchmarks can report them.
+ */
+static std::atomic<long> allocationCount(0);
+static std::atomic<long> allocatedBytes(0);
+
+void* operator new(std::size_t size)
+{
+    ++allocationCount;
+    allocatedBytes += size;
+    if (void* p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+    void appendChildren(QStandardItem* parent, int fanout, int depth)
+    {
+        if (depth == 0)
+            return;
+        for (int i = 0; i < fanout; ++i) {
+            QStandardItem* child = new QStandardItem(QString("Item %1").arg(i));
+            appendChildren(child, fanout, depth - 1);
+            parent->appendRow(child);
+        }
+    }
+
+    /**
+     * Creates a tree of fanout + fanout^2 + ... + fanout^depth items.
+     */
+    void makeLargeStandardItemModel(QStandardItemModel* model, int fanout, int depth)
+    {
+        appendChildren(model->invisibleRootItem(), fanout, depth);
+    }
+
+    // a stand-in with the size of a tree item, to compare the pool with plain new/delete
+    struct Node
+    {
+        char data[sizeof(TreeItemViewModel)];
+    };
+}
+
+TEST_CASE("Benchmark: resetting a large tree", "[!benchmark]")
+{
+    QStandardItemModel sourceModel;
+    makeLargeStandardItemModel(&sourceModel, 10, 5);
+    TreeViewModel treeViewModel;
+
+    long before = allocationCount;
+    treeViewModel.setSourceModel(&sourceModel);
+    long allocations = allocationCount - before;
+
+    std::cout << "Items: " << treeViewModel.rowCount() << std::endl
+              << "Heap allocations for the first reset: " << allocations << " ("
+              << double(allocations) / treeViewModel.rowCount() << " per item)" << std::endl;
+
+    BENCHMARK("Reset the model") {
+        treeViewModel.setSourceModel(&sourceModel);
+    }
+
+    REQUIRE(treeViewModel.rowCount() == 111110);
+}
+
+TEST_CASE("Benchmark: allocating tree items from a pool or from the heap", "[!benchmark]")
+{
+    const int count = 500000;
+    QVector<Node*> nodes(count);
+
+    long before = allocationCount;
+    BENCHMARK("Allocate and free the items one by one") {
+        for (int i = 0; i < count; ++i)
+            nodes[i] = new Node();
+        for (int i = 0; i < count; ++i)
+            delete nodes[i];
+    }
+    long heapAllocations = allocationCount - before;
+
+    ItemPool<Node> pool;
+    before = allocationCount;
+    BENCHMARK("Allocate the items from a pool and release it at once") {
+        for (int i = 0; i < count; ++i)
+            nodes[i] = pool.create();
+        pool.clear();
+    }
+    long poolAllocations = allocationCount - before;
+
+    std::cout << "Heap allocations for " << count << " items: " << heapAllocations << " with new/delete, "
+              << poolAllocations << " with the pool" << std::endl;
+
+    REQUIRE(poolAllocations < heapAllocations);
+}
+
+TEST_CASE("Benchmark: memory used by the items of a large tree", "[!benchmark]")
+{
+    QStandardItemModel sourceModel;
+    makeLargeStandardItemModel(&sourceModel, 10, 5);
+    TreeViewModel treeViewModel;
+
+    long before = allocatedBytes;
+    treeViewModel.setSourceModel(&sourceModel);
+    long bytes = allocatedBytes - before;
+
+    std::cout << "Size of an item: " << sizeof(TreeItemViewModel) << " bytes" << std::endl
+              << "Heap bytes allocated by the first reset: " << bytes << " ("
+              << double(bytes) / treeViewModel.rowCount() << " per item, including the persistent source indexes, "
+              << "the lookup table and the flattened tree)" << std::endl;
+
+    REQUIRE(treeViewModel.rowCount() == 111110);
+}
+
+TEST_CASE("Benchmark: delegate bindings notified when an item is toggled", "[!benchmark]")
+{
+    QStandardItemModel sourceModel;
+    makeLargeStandardItemModel(&sourceModel, 10, 4);
+    TreeViewModel treeViewModel;
+    treeViewModel.setSourceModel(&sourceModel);
+    const int roleCount = treeViewModel.roleNames().count();
+
+    // a change notified without roles re-evaluates the bindings of all the roles of the delegate
+    int notifiedRoles = 0;
+    int notifiedRows = 0;
+    QObject::connect(&treeViewModel, &QAbstractItemModel::dataChanged,
+                     [&](const QModelIndex& topLeft, const QModelIndex& bottomRight, const QVector<int>& roles) {
+                         int rows = bottomRight.row() - topLeft.row() + 1;
+                         notifiedRows += rows;
+                         notifiedRoles += rows * (roles.isEmpty() ? roleCount : roles.count());
+                     });
+
+    treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+
+    std::cout << "Expanding an item with 1110 descendants notifies " << notifiedRows << " rows and "
+              << notifiedRoles << " role bindings (" << notifiedRows * roleCount
+              << " without role scoping)" << std::endl;
+
+    REQUIRE(notifiedRoles == notifiedRows);
+}
+
+TEST_CASE("Benchmark: looking up the expanded state of the items", "[!benchmark]")
+{
+    QStandardItemModel sourceModel;
+    makeLargeStandardItemModel(&sourceModel, 10, 4);
+    QModelIndexList indexes;
+    for (int i = 0; i < sourceModel.rowCount(); ++i) {
+        QModelIndex index = sourceModel.index(i, 0);
+        indexes.append(index);
+        for (int j = 0; j < sourceModel.rowCount(index); ++j)
+            indexes.append(sourceModel.index(j, 0, index));
+    }
+
+    // the previous store: an ordered map of model indexes to the expanded state
+    long before = allocatedBytes;
+    QMap<QModelIndex, bool> expandedMap;
+    for (const QModelIndex& index: indexes)
+        expandedMap[QPersistentModelIndex(index)] = true;
+    long mapBytes = allocatedBytes - before;
+
+    before = allocatedBytes;
+    PersistentIndexSet expandedIndexes;
+    expandedIndexes.setModels({&sourceModel});
+    for (const QModelIndex& index: indexes)
+        expandedIndexes.insert(QPersistentModelIndex(index));
+    long setBytes = allocatedBytes - before;
+
+    std::cout << "Heap bytes allocated to store " << indexes.count() << " expanded items: " << mapBytes
+              << " with a map of indexes, " << setBytes << " with a set of persistent indexes" << std::endl;
+
+    int found = 0;
+    BENCHMARK("Look up the items in a map of indexes") {
+        for (const QModelIndex& index: indexes)
+            found += expandedMap.value(QPersistentModelIndex(index), false);
+    }
+    BENCHMARK("Look up the items in a set of persistent indexes") {
+        for (const QModelIndex& index: indexes)
+            found += expandedIndexes.contains(QPersistentModelIndex(index));
+    }
+
+    REQUIRE(found > 0);
+}
+
+TEST_CASE("Benchmark: expanded state kept by a long running session", "[!benchmark]")
+{
+    QStandardItemModel sourceModel;
+    TreeViewModel treeViewModel;
+    treeViewModel.setSourceModel(&sourceModel);
+
+    // the rows are replaced over and over, like the entries of a refreshed directory: the expanded state of the removed
+    // rows must not accumulate, each round would otherwise be slower than the previous one
+    auto expandAndRemoveRows = [&]() {
+        makeLargeStandardItemModel(&sourceModel, 10, 2);
+        for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+            if (treeViewModel.data(treeViewModel.index(row), TreeViewModel::HasChildren).toBool())
+                treeViewModel.setData(treeViewModel.index(row), true, TreeViewModel::IsExpanded);
+        }
+        sourceModel.invisibleRootItem()->removeRows(0, sourceModel.rowCount());
+    };
+
+    BENCHMARK("Expand 10 items then remove their 110 rows") {
+        expandAndRemoveRows();
+    }
+
+    long before = allocatedBytes;
+    expandAndRemoveRows();
+    long bytes = allocatedBytes - before;
+    std::cout << "Heap bytes allocated by a round once many rounds have been run: " << bytes << std::endl;
+
+    REQUIRE(treeViewModel.rowCount() == 0);
+}
+
+TEST_CASE("Benchmark: expanding every item of a large tree", "[!benchmark]")
+{
+    QStandardItemModel sourceModel;
+    makeLargeStandardItemModel(&sourceModel, 10, 4);
+    TreeViewModel treeViewModel;
+    treeViewModel.setSourceModel(&sourceModel);
+    int notifications = 0;
+    QObject::connect(&treeViewModel, &QAbstractItemModel::dataChanged, [&]() { ++notifications; });
+
+    BENCHMARK("Expand the items one row at a time") {
+        for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+            if (treeViewModel.data(treeViewModel.index(row), TreeViewModel::HasChildren).toBool())
+                treeViewModel.setData(treeViewModel.index(row), true, TreeViewModel::IsExpanded);
+        }
+    }
+    int rowByRowNotifications = notifications;
+
+    treeViewModel.collapseAll();
+    notifications = 0;
+    BENCHMARK("Expand the items with expandAll") {
+        treeViewModel.expandAll();
+    }
+
+    std::cout << "Change notifications to expand " << treeViewModel.rowCount() << " items: " << rowByRowNotifications
+              << " one row at a time, " << notifications << " with expandAll" << std::endl;
+
+    REQUIRE(notifications == 1);
+}
@@ -1,4 +1,10 @@
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QIdentityProxyModel>
 #include <QtGui/QStandardItemModel>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
 #include <TreeViewModel.h>
 #include "catch.hpp"
 
@@ -25,6 +31,343 @@ QList<QStandardItem*> makeBasicStandardItemModel(QStandardItemModel* standardIte
     return allItems;
 }
 
+/**
+ * QStandardItemModel that records the parents whose rows have been counted.
+ */
+class RowCountRecordingModel: public QStandardItemModel
+{
+public:
+    int rowCount(const QModelIndex &parent=QModelIndex()) const override
+    {
+        countedParents.append(parent.data().toString());
+        return QStandardItemModel::rowCount(parent);
+    }
+
+    mutable QStringList countedParents;
+};
+
+/**
+ * QStandardItemModel that counts the calls to hasChildren.
+ */
+class HasChildrenCountingModel: public QStandardItemModel
+{
+public:
+    bool hasChildren(const QModelIndex &parent=QModelIndex()) const override
+    {
+        ++hasChildrenCalls;
+        return QStandardItemModel::hasChildren(parent);
+    }
+
+    mutable int hasChildrenCalls = 0;
+};
+
+/**
+ * QStandardItemModel whose lazy items load their children asynchronously, like the directories of a QFileSystemModel:
+ * fetchMore only records the request, the rows are inserted later.
+ */
+class LazyFetchModel: public QStandardItemModel
+{
+public:
+    bool hasChildren(const QModelIndex &parent=QModelIndex()) const override
+    {
+        return lazyItems.contains(parent.data().toString()) || QStandardItemModel::hasChildren(parent);
+    }
+
+    bool canFetchMore(const QModelIndex &parent) const override
+    {
+        QString text = parent.data().toString();
+        return lazyItems.contains(text) && !fetchedItems.contains(text);
+    }
+
+    void fetchMore(const QModelIndex &parent) override
+    {
+        fetchedItems.append(parent.data().toString());
+        // a source model that fetches synchronously inserts the rows before fetchMore returns
+        for (int i = 0; i < rowsPerFetch; ++i)
+            itemFromIndex(parent)->appendRow(new QStandardItem(QString("File %1").arg(i)));
+    }
+
+    QStringList lazyItems;
+    QStringList fetchedItems;
+    int rowsPerFetch = 0;
+};
+
+/**
+ * QStandardItemModel whose rowCount takes at least a millisecond, so that each item is built in its own time slice.
+ */
+class SlowRowCountModel: public QStandardItemModel
+{
+public:
+    int rowCount(const QModelIndex &parent=QModelIndex()) const override
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return QStandardItemModel::rowCount(parent);
+    }
+};
+
+/**
+ * LazyFetchModel whose rowCount takes at least a millisecond, see SlowRowCountModel.
+ */
+class SlowLazyFetchModel: public LazyFetchModel
+{
+public:
+    int rowCount(const QModelIndex &parent=QModelIndex()) const override
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return LazyFetchModel::rowCount(parent);
+    }
+};
+
+/**
+ * QIdentityProxyModel that counts the indexes it maps to its source model.
+ */
+class MapCountingProxyModel: public QIdentityProxyModel
+{
+public:
+    QModelIndex mapToSource(const QModelIndex &proxyIndex) const override
+    {
+        ++mappedIndexes;
+        return QIdentityProxyModel::mapToSource(proxyIndex);
+    }
+
+    mutable int mappedIndexes = 0;
+};
+
+/**
+ * Minimal tree model whose rows can be moved (QStandardItemModel does not implement moveRows).
+ */
+class MovableTreeModel: public QAbstractItemModel
+{
+public:
+    struct Item
+    {
+        ~Item() { qDeleteAll(children); }
+
+        QString text;
+        Item* parent = nullptr;
+        QList<Item*> children;
+    };
+
+    Item* appendItem(Item* parent, const QString& text)
+    {
+        Item* item = new Item();
+        item->text = text;
+        item->parent = parent;
+        parent->children.append(item);
+        return item;
+    }
+
+    Item* root()
+    {
+        return &root_;
+    }
+
+    QModelIndex indexOf(Item* item) const
+    {
+        if (item == &root_)
+            return QModelIndex();
+        return createIndex(item->parent->children.indexOf(item), 0, item);
+    }
+
+    QModelIndex index(int row, int column, const QModelIndex &parent=QModelIndex()) const override
+    {
+        Item* parentItem = itemOf(parent);
+        if (row < 0 || row >= parentItem->children.count() || column != 0)
+            return QModelIndex();
+        return createIndex(row, column, parentItem->children[row]);
+    }
+
+    QModelIndex parent(const QModelIndex &child) const override
+    {
+        if (!child.isValid())
+            return QModelIndex();
+        return indexOf(itemOf(child)->parent);
+    }
+
+    int rowCount(const QModelIndex &parent=QModelIndex()) const override
+    {
+        return itemOf(parent)->children.count();
+    }
+
+    int columnCount(const QModelIndex &parent=QModelIndex()) const override
+    {
+        Q_UNUSED(parent);
+        return 1;
+    }
+
+    QVariant data(const QModelIndex &index, int role=Qt::DisplayRole) const override
+    {
+        if (!index.isValid() || role != Qt::DisplayRole)
+            return QVariant();
+        return itemOf(index)->text;
+    }
+
+    bool moveRows(const QModelIndex &sourceParent, int sourceRow, int count, const QModelIndex &destinationParent,
+                  int destinationChild) override
+    {
+        if (!beginMoveRows(sourceParent, sourceRow, sourceRow + count - 1, destinationParent, destinationChild))
+            return false;
+        Item* from = itemOf(sourceParent);
+        Item* to = itemOf(destinationParent);
+        QList<Item*> moved = from->children.mid(sourceRow, count);
+        for (int i = 0; i < count; ++i)
+            from->children.removeAt(sourceRow);
+        if (from == to && destinationChild > sourceRow)
+            destinationChild -= count;
+        for (int i = 0; i < count; ++i) {
+            to->children.insert(destinationChild + i, moved[i]);
+            moved[i]->parent = to;
+        }
+        endMoveRows();
+        return true;
+    }
+
+    /**
+     * Changes the items inside a reset of the model.
+     */
+    void reset(const std::function<void(Item* root)>& change)
+    {
+        beginResetModel();
+        change(&root_);
+        endResetModel();
+    }
+
+private:
+    Item* itemOf(const QModelIndex& index) const
+    {
+        if (!index.isValid())
+            return const_cast<Item*>(&root_);
+        return static_cast<Item*>(index.internalPointer());
+    }
+
+    Item root_;
+};
+
+/**
+ * Minimal tree model whose indexes get a new internal id at every layout change, like the indexes of a
+ * QSortFilterProxyModel, which recreates all its mappings when its source model changes its layout.
+ */
+class RemappingTreeModel: public QAbstractItemModel
+{
+public:
+    typedef MovableTreeModel::Item Item;
+
+    Item* appendItem(Item* parent, const QString& text)
+    {
+        Item* item = new Item();
+        item->text = text;
+        item->parent = parent;
+        parent->children.append(item);
+        items_.append(item);
+        return item;
+    }
+
+    Item* root()
+    {
+        return &root_;
+    }
+
+    QModelIndex indexOf(Item* item) const
+    {
+        if (item == &root_)
+            return QModelIndex();
+        quintptr id = quintptr(generation_) * 1000 + quintptr(items_.indexOf(item));
+        return createIndex(item->parent->children.indexOf(item), 0, id);
+    }
+
+    /**
+     * Reverses the order of the children of parent, the layout change only names parent.
+     */
+    void reverseChildren(Item* parent)
+    {
+        QList<QPersistentModelIndex> parents{QPersistentModelIndex(indexOf(parent))};
+        emit layoutAboutToBeChanged(parents, QAbstractItemModel::VerticalSortHint);
+        QModelIndexList oldIndexes = persistentIndexList();
+        QList<Item*> items;
+        for (const QModelIndex& index: oldIndexes)
+            items.append(itemOf(index));
+        std::reverse(parent->children.begin(), parent->children.end());
+        ++generation_;
+        QModelIndexList newIndexes;
+        for (Item* item: items)
+            newIndexes.append(indexOf(item));
+        changePersistentIndexList(oldIndexes, newIndexes);
+        emit layoutChanged(parents, QAbstractItemModel::VerticalSortHint);
+    }
+
+    QModelIndex index(int row, int column, const QModelIndex &parent=QModelIndex()) const override
+    {
+        Item* parentItem = itemOf(parent);
+        if (row < 0 || row >= parentItem->children.count() || column != 0)
+            return QModelIndex();
+        return indexOf(parentItem->children[row]);
+    }
+
+    QModelIndex parent(const QModelIndex &child) const override
+    {
+        if (!child.isValid())
+            return QModelIndex();
+        return indexOf(itemOf(child)->parent);
+    }
+
+    int rowCount(const QModelIndex &parent=QModelIndex()) const override
+    {
+        return itemOf(parent)->children.count();
+    }
+
+    int columnCount(const QModelIndex &parent=QModelIndex()) const override
+    {
+        Q_UNUSED(parent);
+        return 1;
+    }
+
+    QVariant data(const QModelIndex &index, int role=Qt::DisplayRole) const override
+    {
+        if (!index.isValid() || role != Qt::DisplayRole)
+            return QVariant();
+        return itemOf(index)->text;
+    }
+
+private:
+    Item* itemOf(const QModelIndex& index) const
+    {
+        if (!index.isValid())
+            return const_cast<Item*>(&root_);
+        return items_[int(index.internalId() % 1000)];
+    }
+
+    Item root_;
+    QList<Item*> items_;
+    int generation_ = 0;
+};
+
+/**
+ * Fills the model with the same tree as makeBasicStandardItemModel.
+ */
+QList<MovableTreeModel::Item*> makeBasicMovableTreeModel(MovableTreeModel* model)
+{
+    QList<MovableTreeModel::Item*> allItems;
+    MovableTreeModel::Item* root = model->appendItem(model->root(), "Root"); allItems.append(root);
+    MovableTreeModel::Item* child1 = model->appendItem(root, "Child 1"); allItems.append(child1);
+    allItems.append(model->appendItem(child1, "Child 1 of Child 1"));
+    allItems.append(model->appendItem(child1, "Child 2 of Child 1"));
+    MovableTreeModel::Item* child2 = model->appendItem(root, "Child 2"); allItems.append(child2);
+    allItems.append(model->appendItem(child2, "Child 1 of Child 2"));
+    allItems.append(model->appendItem(root, "Child 3"));
+    return allItems;
+}
+
+/**
+ * Returns the display text of each row of the model.
+ */
+QStringList rowTexts(const TreeViewModel& treeViewModel)
+{
+    QStringList texts;
+    for (int row = 0; row < treeViewModel.rowCount(); ++row)
+        texts.append(treeViewModel.data(treeViewModel.index(row), Qt::DisplayRole).toString());
+    return texts;
+}
+
 SCENARIO("TreeViewModel can be created from a static pre-filled QStandardItemModel")
 {
     TreeViewModel treeViewModel;
@@ -143,6 +486,1647 @@ SCENARIO("TreeItem can be inserted dynamically")
                 REQUIRE(treeViewModel.data(insertedItemIndex, Qt::DisplayRole).toString().toStdString() == insertedItem->text().toStdString());
                 REQUIRE(treeViewModel.data(child2OfChild1Index, Qt::DisplayRole).toString().toStdString() == secondChildText.toStdString());
             }
+
+            AND_THEN("the inserted item and the shifted sibling are mapped from the source model to their new row") {
+                REQUIRE(treeViewModel.mapFromSource(insertedItem->index()).row() == 3);
+                REQUIRE(treeViewModel.mapFromSource(allItems[3]->index()).row() == 4);
+                REQUIRE(treeViewModel.mapFromSource(allItems[2]->index()).row() == 2);
+            }
+        }
+    }
+}
+
+SCENARIO("TreeItem can be inserted dynamically before an item that has children")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+
+        QStandardItem* root = allItems[0];
+        QStandardItem* child2 = allItems[4];
+
+        WHEN("a new item is inserted in the source model before Child 2") {
+            QStandardItem* insertedItem = new QStandardItem("Inserted Item");
+            root->insertRow(1, insertedItem);
+
+            THEN("inserted item is right before Child 2 and its children") {
+                REQUIRE(treeViewModel.rowCount() == allItems.count() + 1);
+                REQUIRE(treeViewModel.data(treeViewModel.index(4), Qt::DisplayRole).toString().toStdString() == insertedItem->text().toStdString());
+                REQUIRE(treeViewModel.data(treeViewModel.index(5), Qt::DisplayRole).toString().toStdString() == child2->text().toStdString());
+                REQUIRE(treeViewModel.mapFromSource(child2->index()).row() == 5);
+                REQUIRE(treeViewModel.mapFromSource(allItems[6]->index()).row() == 7);
+            }
+        }
+    }
+}
+
+SCENARIO("TreeViewModel can expose the visible rows only")
+{
+    GIVEN("A TreeViewModel in visible rows only mode") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+
+        int insertedFirst = -1, insertedLast = -1, removedFirst = -1, removedLast = -1;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsInserted,
+                         [&](const QModelIndex&, int first, int last) { insertedFirst = first; insertedLast = last; });
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsRemoved,
+                         [&](const QModelIndex&, int first, int last) { removedFirst = first; removedLast = last; });
+
+        THEN("only root is a row") {
+            REQUIRE(treeViewModel.rowCount() == 1);
+            REQUIRE(treeViewModel.data(treeViewModel.index(0), Qt::DisplayRole).toString().toStdString() == "Root");
+            REQUIRE(!treeViewModel.mapFromSource(allItems[1]->index()).isValid());
+        }
+
+        WHEN("root is expanded") {
+            treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+
+            THEN("the rows of its children are inserted") {
+                REQUIRE(insertedFirst == 1);
+                REQUIRE(insertedLast == 3);
+                REQUIRE(treeViewModel.rowCount() == 4);
+                REQUIRE(treeViewModel.data(treeViewModel.index(1), Qt::DisplayRole).toString().toStdString() == "Child 1");
+                REQUIRE(treeViewModel.data(treeViewModel.index(2), Qt::DisplayRole).toString().toStdString() == "Child 2");
+                REQUIRE(treeViewModel.data(treeViewModel.index(3), Qt::DisplayRole).toString().toStdString() == "Child 3");
+                REQUIRE(!treeViewModel.data(treeViewModel.index(1), TreeViewModel::Hidden).toBool());
+            }
+
+            AND_WHEN("Child 2 is expanded") {
+                treeViewModel.setData(treeViewModel.index(2), true, TreeViewModel::IsExpanded);
+
+                THEN("the row of its child is inserted after it") {
+                    REQUIRE(insertedFirst == 3);
+                    REQUIRE(insertedLast == 3);
+                    REQUIRE(treeViewModel.rowCount() == 5);
+                    REQUIRE(treeViewModel.data(treeViewModel.index(3), Qt::DisplayRole).toString().toStdString() == "Child 1 of Child 2");
+                    REQUIRE(treeViewModel.mapFromSource(allItems[6]->index()).row() == 4);
+                }
+
+                AND_WHEN("root is collapsed and expanded again") {
+                    treeViewModel.setData(treeViewModel.index(0), false, TreeViewModel::IsExpanded);
+
+                    REQUIRE(removedFirst == 1);
+                    REQUIRE(removedLast == 4);
+                    REQUIRE(treeViewModel.rowCount() == 1);
+
+                    treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+
+                    THEN("Child 2 is still expanded") {
+                        REQUIRE(insertedFirst == 1);
+                        REQUIRE(insertedLast == 4);
+                        REQUIRE(treeViewModel.rowCount() == 5);
+                        REQUIRE(treeViewModel.data(treeViewModel.index(3), Qt::DisplayRole).toString().toStdString() == "Child 1 of Child 2");
+                    }
+                }
+            }
+
+            AND_WHEN("a new item is inserted in a collapsed item") {
+                allItems[1]->appendRow(new QStandardItem("Inserted Item"));
+
+                THEN("no row is inserted") {
+                    REQUIRE(treeViewModel.rowCount() == 4);
+                    REQUIRE(treeViewModel.data(treeViewModel.index(2), Qt::DisplayRole).toString().toStdString() == "Child 2");
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("TreeViewModel only reads the children of an item when it is expanded in visible rows only mode")
+{
+    GIVEN("A TreeViewModel in visible rows only mode") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        unique_ptr<RowCountRecordingModel> standardItemModel = make_unique<RowCountRecordingModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+
+        WHEN("the source model is set") {
+            standardItemModel->countedParents.clear();
+            treeViewModel.setSourceModel(standardItemModel.get());
+
+            THEN("the children of root are not read") {
+                REQUIRE(!standardItemModel->countedParents.contains("Root"));
+                REQUIRE(treeViewModel.data(treeViewModel.index(0), TreeViewModel::HasChildren).toBool());
+            }
+
+            AND_WHEN("root is expanded") {
+                treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+
+                THEN("its children are read but not their own children") {
+                    REQUIRE(standardItemModel->countedParents.contains("Root"));
+                    REQUIRE(!standardItemModel->countedParents.contains("Child 1"));
+                    REQUIRE(treeViewModel.rowCount() == 4);
+                }
+
+                AND_WHEN("an item is inserted in a collapsed child that has never been expanded") {
+                    allItems[1]->appendRow(new QStandardItem("Inserted Item"));
+                    treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+
+                    THEN("it shows up when the child is expanded") {
+                        REQUIRE(treeViewModel.rowCount() == 7);
+                        REQUIRE(treeViewModel.data(treeViewModel.index(4), Qt::DisplayRole).toString().toStdString() == "Inserted Item");
+                        REQUIRE(treeViewModel.data(treeViewModel.index(5), Qt::DisplayRole).toString().toStdString() == "Child 2");
+                    }
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("TreeViewModel keeps the rows of the items consistent while the tree grows")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+
+        WHEN("items are appended at several levels and inserted in the middle") {
+            for (int i = 0; i < 5; ++i) {
+                QStandardItem* item = new QStandardItem(QString("Appended %1").arg(i));
+                allItems[0]->appendRow(item);
+                item->appendRow(new QStandardItem(QString("Child of Appended %1").arg(i)));
+            }
+            allItems[2]->appendRow(new QStandardItem("Child of Child 1 of Child 1"));
+            allItems[4]->insertRow(0, new QStandardItem("First child of Child 2"));
+
+            THEN("each row is mapped back from its source index") {
+                REQUIRE(treeViewModel.rowCount() == 19);
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+
+            AND_THEN("the items are in depth first order") {
+                REQUIRE(treeViewModel.data(treeViewModel.index(3), Qt::DisplayRole).toString().toStdString() == "Child of Child 1 of Child 1");
+                REQUIRE(treeViewModel.data(treeViewModel.index(6), Qt::DisplayRole).toString().toStdString() == "First child of Child 2");
+                REQUIRE(treeViewModel.data(treeViewModel.index(9), Qt::DisplayRole).toString().toStdString() == "Appended 0");
+                REQUIRE(treeViewModel.data(treeViewModel.index(18), Qt::DisplayRole).toString().toStdString() == "Child of Appended 4");
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeItems can be inserted by blocks")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        QList<QPair<int, int>> insertedRanges;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsInserted,
+                         [&](const QModelIndex&, int first, int last) { insertedRanges.append(qMakePair(first, last)); });
+
+        WHEN("several items that have children are inserted before Child 2 at once") {
+            QList<QStandardItem*> items;
+            for (int i = 0; i < 3; ++i) {
+                QStandardItem* item = new QStandardItem(QString("Inserted %1").arg(i));
+                item->appendRow(new QStandardItem(QString("Child of Inserted %1").arg(i)));
+                items.append(item);
+            }
+            allItems[0]->insertRows(1, items);
+
+            THEN("their rows and the rows of their children are inserted with a single notification") {
+                REQUIRE(insertedRanges.count() == 1);
+                REQUIRE(insertedRanges[0].first == 4);
+                REQUIRE(insertedRanges[0].second == 9);
+                REQUIRE(treeViewModel.rowCount() == 13);
+            }
+
+            AND_THEN("the items are in depth first order") {
+                REQUIRE(treeViewModel.data(treeViewModel.index(4), Qt::DisplayRole).toString().toStdString() == "Inserted 0");
+                REQUIRE(treeViewModel.data(treeViewModel.index(5), Qt::DisplayRole).toString().toStdString() == "Child of Inserted 0");
+                REQUIRE(treeViewModel.data(treeViewModel.index(9), Qt::DisplayRole).toString().toStdString() == "Child of Inserted 2");
+                REQUIRE(treeViewModel.data(treeViewModel.index(10), Qt::DisplayRole).toString().toStdString() == "Child 2");
+                REQUIRE(treeViewModel.data(treeViewModel.index(10), TreeViewModel::Indentation).toInt() == 1);
+                REQUIRE(treeViewModel.data(treeViewModel.index(5), TreeViewModel::Indentation).toInt() == 2);
+            }
+
+            AND_THEN("each row is mapped back from its source index") {
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeItems can be removed dynamically")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        QList<QPair<int, int>> removedRanges;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsRemoved,
+                         [&](const QModelIndex&, int first, int last) { removedRanges.append(qMakePair(first, last)); });
+
+        WHEN("an item that has children is removed from the source model") {
+            allItems[0]->removeRow(0);
+
+            THEN("the rows of the item and of its children are removed at once") {
+                REQUIRE(removedRanges.count() == 1);
+                REQUIRE(removedRanges[0].first == 1);
+                REQUIRE(removedRanges[0].second == 3);
+                REQUIRE(treeViewModel.rowCount() == 4);
+                REQUIRE(treeViewModel.data(treeViewModel.index(1), Qt::DisplayRole).toString().toStdString() == "Child 2");
+            }
+
+            AND_THEN("the shifted siblings are mapped from the source model to their new row") {
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+
+            AND_WHEN("a new item is inserted after the removal") {
+                allItems[0]->appendRow(new QStandardItem("Inserted Item"));
+
+                THEN("it is inserted at the end") {
+                    REQUIRE(treeViewModel.rowCount() == 5);
+                    REQUIRE(treeViewModel.data(treeViewModel.index(4), Qt::DisplayRole).toString().toStdString() == "Inserted Item");
+                }
+            }
+        }
+
+        WHEN("several items are removed at once") {
+            allItems[0]->removeRows(1, 2);
+
+            THEN("their rows are removed at once") {
+                REQUIRE(removedRanges.count() == 1);
+                REQUIRE(removedRanges[0].first == 4);
+                REQUIRE(removedRanges[0].second == 6);
+                REQUIRE(treeViewModel.rowCount() == 4);
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel in visible rows only mode") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+        treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+        treeViewModel.setData(treeViewModel.index(1), false, TreeViewModel::IsExpanded);
+        int removedRows = 0;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsRemoved,
+                         [&](const QModelIndex&, int first, int last) { removedRows += last - first + 1; });
+
+        WHEN("an item is removed from a collapsed item") {
+            allItems[1]->removeRow(0);
+
+            THEN("no row is removed") {
+                REQUIRE(removedRows == 0);
+                REQUIRE(treeViewModel.rowCount() == 4);
+            }
+
+            AND_WHEN("the collapsed item is expanded") {
+                treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+
+                THEN("only its remaining child is shown") {
+                    REQUIRE(treeViewModel.rowCount() == 5);
+                    REQUIRE(treeViewModel.data(treeViewModel.index(2), Qt::DisplayRole).toString().toStdString() == "Child 2 of Child 1");
+                }
+            }
         }
     }
-}
\ No newline at end of file
+}
+
+
+SCENARIO("TreeItems can be moved dynamically")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        MovableTreeModel sourceModel;
+        QList<MovableTreeModel::Item*> allItems = makeBasicMovableTreeModel(&sourceModel);
+        treeViewModel.setSourceModel(&sourceModel);
+        int movedSignals = 0;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsMoved, [&]() { ++movedSignals; });
+        QPersistentModelIndex child1Row = treeViewModel.index(1);
+
+        WHEN("an item that has children is moved after one of its siblings") {
+            sourceModel.moveRows(sourceModel.indexOf(allItems[0]), 0, 1, sourceModel.indexOf(allItems[0]), 2);
+
+            THEN("the rows of the item and of its children are moved at once") {
+                REQUIRE(movedSignals == 1);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 2", "Child 1 of Child 2", "Child 1",
+                                                                "Child 1 of Child 1", "Child 2 of Child 1", "Child 3"}));
+                REQUIRE(child1Row.row() == 3);
+            }
+
+            AND_THEN("each row is mapped back from its source index") {
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+        }
+
+        WHEN("an item that has children is moved to another parent") {
+            sourceModel.moveRows(sourceModel.indexOf(allItems[0]), 0, 1, sourceModel.indexOf(allItems[4]), 1);
+
+            THEN("its rows are moved after the children of the new parent") {
+                REQUIRE(movedSignals == 1);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 2", "Child 1 of Child 2", "Child 1",
+                                                                "Child 1 of Child 1", "Child 2 of Child 1", "Child 3"}));
+            }
+
+            AND_THEN("they are re-indented") {
+                REQUIRE(treeViewModel.data(treeViewModel.index(3), TreeViewModel::Indentation).toInt() == 2);
+                REQUIRE(treeViewModel.data(treeViewModel.index(4), TreeViewModel::Indentation).toInt() == 3);
+            }
+
+            AND_THEN("each row is mapped back from its source index") {
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+        }
+
+        WHEN("an item is moved to its grandparent, right after its former parent") {
+            sourceModel.moveRows(sourceModel.indexOf(allItems[4]), 0, 1, sourceModel.indexOf(allItems[0]), 2);
+
+            THEN("the order of the rows does not change but the item is re-indented") {
+                REQUIRE(movedSignals == 0);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                "Child 2 of Child 1", "Child 2", "Child 1 of Child 2",
+                                                                "Child 3"}));
+                REQUIRE(treeViewModel.data(treeViewModel.index(5), TreeViewModel::Indentation).toInt() == 1);
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel in visible rows only mode") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        MovableTreeModel sourceModel;
+        QList<MovableTreeModel::Item*> allItems = makeBasicMovableTreeModel(&sourceModel);
+        treeViewModel.setSourceModel(&sourceModel);
+        treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+
+        WHEN("an item is moved into a collapsed item") {
+            sourceModel.moveRows(sourceModel.indexOf(allItems[0]), 2, 1, sourceModel.indexOf(allItems[1]), 0);
+
+            THEN("its row is removed") {
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 2"}));
+            }
+
+            AND_WHEN("the collapsed item is expanded") {
+                treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+
+                THEN("the moved item is its first child") {
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 3", "Child 1 of Child 1",
+                                                                    "Child 2 of Child 1", "Child 2"}));
+                }
+            }
+        }
+
+        WHEN("an item is moved out of a collapsed item") {
+            treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+            treeViewModel.setData(treeViewModel.index(1), false, TreeViewModel::IsExpanded);
+            sourceModel.moveRows(sourceModel.indexOf(allItems[1]), 1, 1, sourceModel.indexOf(allItems[0]), 3);
+
+            THEN("its row is inserted") {
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 2", "Child 3",
+                                                                "Child 2 of Child 1"}));
+                REQUIRE(treeViewModel.data(treeViewModel.index(4), TreeViewModel::Indentation).toInt() == 1);
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeItems are reordered when the source model is sorted")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        int resets = 0;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::modelReset, [&]() { ++resets; });
+        QPersistentModelIndex child1Row = treeViewModel.index(1);
+        QPersistentModelIndex child1OfChild2Row = treeViewModel.index(5);
+
+        WHEN("the children of root are sorted in descending order") {
+            allItems[0]->sortChildren(0, Qt::DescendingOrder);
+
+            THEN("the rows of the sibling groups are reordered without resetting the model") {
+                REQUIRE(resets == 0);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 3", "Child 2", "Child 1 of Child 2",
+                                                                "Child 1", "Child 1 of Child 1", "Child 2 of Child 1"}));
+            }
+
+            AND_THEN("the persistent indexes follow their item") {
+                REQUIRE(child1Row.row() == 4);
+                REQUIRE(child1OfChild2Row.row() == 3);
+            }
+
+            AND_THEN("each row is mapped back from its source index") {
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+
+            AND_WHEN("the children of Child 1 are sorted in descending order") {
+                allItems[1]->sortChildren(0, Qt::DescendingOrder);
+
+                THEN("only its children are reordered") {
+                    REQUIRE(resets == 0);
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 3", "Child 2", "Child 1 of Child 2",
+                                                                    "Child 1", "Child 2 of Child 1", "Child 1 of Child 1"}));
+                }
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel on a source model whose indexes all change at every layout change") {
+        TreeViewModel treeViewModel;
+        RemappingTreeModel sourceModel;
+        RemappingTreeModel::Item* root = sourceModel.appendItem(sourceModel.root(), "Root");
+        RemappingTreeModel::Item* child1 = sourceModel.appendItem(root, "Child 1");
+        sourceModel.appendItem(child1, "Child 1 of Child 1");
+        sourceModel.appendItem(child1, "Child 2 of Child 1");
+        sourceModel.appendItem(sourceModel.appendItem(root, "Child 2"), "Child 1 of Child 2");
+        treeViewModel.setSourceModel(&sourceModel);
+
+        WHEN("the children of Child 1 are reordered") {
+            sourceModel.reverseChildren(child1);
+
+            THEN("every row, inside or outside of the reordered children, is mapped back from its source index") {
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 2 of Child 1",
+                                                                "Child 1 of Child 1", "Child 2", "Child 1 of Child 2"}));
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel in visible rows only mode") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+        treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+        treeViewModel.setData(treeViewModel.index(1), false, TreeViewModel::IsExpanded);
+
+        WHEN("the children of a collapsed item are sorted") {
+            allItems[1]->sortChildren(0, Qt::DescendingOrder);
+
+            THEN("the rows do not change") {
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 2", "Child 3"}));
+            }
+
+            AND_WHEN("the item is expanded") {
+                treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+
+                THEN("its children are in the new order") {
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 2 of Child 1",
+                                                                    "Child 1 of Child 1", "Child 2", "Child 3"}));
+                }
+            }
+        }
+    }
+}
+
+
+SCENARIO("A reset of the source model can be applied as a diff")
+{
+    GIVEN("A TreeViewModel that applies the resets of its source model as a diff") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setDiffOnReset(true);
+        MovableTreeModel sourceModel;
+        makeBasicMovableTreeModel(&sourceModel);
+        treeViewModel.setSourceModel(&sourceModel);
+        int resets = 0, removedRows = 0, moves = 0, movedRows = 0, insertedRows = 0;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::modelReset, [&]() { ++resets; });
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsRemoved,
+                         [&](const QModelIndex&, int first, int last) { removedRows += last - first + 1; });
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsMoved,
+                         [&](const QModelIndex&, int start, int end) { ++moves; movedRows += end - start + 1; });
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsInserted,
+                         [&](const QModelIndex&, int first, int last) { insertedRows += last - first + 1; });
+        QList<QPair<int, int>> changedRows;
+        QList<QVector<int>> changedRoles;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::dataChanged,
+                         [&](const QModelIndex& topLeft, const QModelIndex& bottomRight, const QVector<int>& roles) {
+                             changedRows.append(qMakePair(topLeft.row(), bottomRight.row()));
+                             changedRoles.append(roles);
+                         });
+        QPersistentModelIndex child1Row = treeViewModel.index(1);
+
+        WHEN("the source model is reset with an item removed, an item moved and an item added") {
+            sourceModel.reset([&](MovableTreeModel::Item* root) {
+                MovableTreeModel::Item* rootItem = root->children[0];
+                delete rootItem->children.takeAt(2);
+                rootItem->children.move(1, 0);
+                sourceModel.appendItem(rootItem, "Child 4");
+            });
+
+            THEN("the model is not reset") {
+                REQUIRE(resets == 0);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 2", "Child 1 of Child 2", "Child 1",
+                                                                "Child 1 of Child 1", "Child 2 of Child 1", "Child 4"}));
+            }
+
+            AND_THEN("only the rows that changed are removed, moved or inserted, a moved subtree as a single range") {
+                REQUIRE(removedRows == 1);
+                REQUIRE(moves == 1);
+                REQUIRE(movedRows == 2);
+                REQUIRE(insertedRows == 1);
+                REQUIRE(child1Row.row() == 3);
+            }
+
+            AND_THEN("the data of the kept rows is notified with the roles that can change") {
+                REQUIRE(changedRows == (QList<QPair<int, int>>{qMakePair(0, 5)}));
+                REQUIRE(changedRoles[0].contains(TreeViewModel::Indentation));
+                REQUIRE(changedRoles[0].contains(TreeViewModel::IsExpanded));
+                REQUIRE(changedRoles[0].contains(Qt::DisplayRole));
+            }
+
+            AND_THEN("each row is mapped back from its source index") {
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+        }
+
+        WHEN("the source model is reset with an item moved after its next siblings") {
+            sourceModel.reset([&](MovableTreeModel::Item* root) {
+                root->children[0]->children.move(0, 2);
+            });
+
+            THEN("the rows of the item and of its children are moved as a single range") {
+                REQUIRE(resets == 0);
+                REQUIRE(moves == 1);
+                REQUIRE(movedRows == 3);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 2", "Child 1 of Child 2", "Child 3",
+                                                                "Child 1", "Child 1 of Child 1", "Child 2 of Child 1"}));
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel in visible rows only mode that applies the resets of its source model as a diff") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        treeViewModel.setDiffOnReset(true);
+        MovableTreeModel sourceModel;
+        makeBasicMovableTreeModel(&sourceModel);
+        treeViewModel.setSourceModel(&sourceModel);
+        treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+        treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+        int resets = 0;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::modelReset, [&]() { ++resets; });
+
+        WHEN("the source model is reset with an item renamed") {
+            sourceModel.reset([&](MovableTreeModel::Item* root) {
+                root->children[0]->children[2]->text = "Child Three";
+            });
+
+            THEN("the expanded items are still expanded") {
+                REQUIRE(resets == 0);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                "Child 2 of Child 1", "Child 2", "Child Three"}));
+                REQUIRE(treeViewModel.data(treeViewModel.index(1), TreeViewModel::IsExpanded).toBool());
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel that applies the resets as a diff, on items whose texts contain the key separators") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setDiffOnReset(true);
+        MovableTreeModel sourceModel;
+        sourceModel.appendItem(sourceModel.root(), "a/b");
+        sourceModel.appendItem(sourceModel.appendItem(sourceModel.root(), "a"), "b");
+        sourceModel.appendItem(sourceModel.root(), "x");
+        sourceModel.appendItem(sourceModel.root(), "x");
+        sourceModel.appendItem(sourceModel.root(), "x#1");
+        treeViewModel.setSourceModel(&sourceModel);
+        int resets = 0;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::modelReset, [&]() { ++resets; });
+
+        WHEN("the source model is reset with the items reordered") {
+            sourceModel.reset([&](MovableTreeModel::Item* root) {
+                root->children.move(0, 4);
+            });
+
+            THEN("each row keeps its own item") {
+                REQUIRE(resets == 0);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"a", "b", "x", "x", "x#1", "a/b"}));
+                for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                    QModelIndex sourceIndex = treeViewModel.mapToSource(treeViewModel.index(row));
+                    REQUIRE(treeViewModel.mapFromSource(sourceIndex).row() == row);
+                }
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel that does not apply the resets of its source model as a diff") {
+        TreeViewModel treeViewModel;
+        MovableTreeModel sourceModel;
+        makeBasicMovableTreeModel(&sourceModel);
+        treeViewModel.setSourceModel(&sourceModel);
+        int resets = 0;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::modelReset, [&]() { ++resets; });
+
+        WHEN("the source model is reset") {
+            sourceModel.reset([&](MovableTreeModel::Item* root) {
+                sourceModel.appendItem(root->children[0], "Child 4");
+            });
+
+            THEN("the model is reset") {
+                REQUIRE(resets == 1);
+                REQUIRE(treeViewModel.rowCount() == 8);
+            }
+        }
+    }
+}
+
+
+SCENARIO("Collapsing and expanding an item notifies the change of its descendants at once")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+        QList<QPair<int, int>> changedRanges;
+        QList<QVector<int>> changedRoles;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::dataChanged,
+                         [&](const QModelIndex& topLeft, const QModelIndex& bottomRight, const QVector<int>& roles) {
+                             changedRanges.append(qMakePair(topLeft.row(), bottomRight.row()));
+                             changedRoles.append(roles);
+                         });
+
+        WHEN("root is collapsed") {
+            treeViewModel.setData(treeViewModel.index(0), false, TreeViewModel::IsExpanded);
+
+            THEN("the hidden state of all its descendants is notified by a single range") {
+                REQUIRE(changedRanges.count() == 2);
+                REQUIRE(changedRanges[0] == qMakePair(1, 6));
+                REQUIRE(changedRoles[0] == QVector<int>{TreeViewModel::Hidden});
+                REQUIRE(changedRanges[1] == qMakePair(0, 0));
+                REQUIRE(changedRoles[1] == QVector<int>{TreeViewModel::IsExpanded});
+            }
+
+            AND_THEN("all its descendants are hidden") {
+                for (int row = 1; row < treeViewModel.rowCount(); ++row)
+                    REQUIRE(treeViewModel.data(treeViewModel.index(row), TreeViewModel::Hidden).toBool());
+            }
+
+            AND_WHEN("Child 1 is expanded while root is collapsed") {
+                changedRanges.clear();
+                treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+
+                THEN("only its own row changes, its children are still hidden") {
+                    REQUIRE(changedRanges.count() == 1);
+                    REQUIRE(changedRanges[0] == qMakePair(1, 1));
+                    REQUIRE(treeViewModel.data(treeViewModel.index(2), TreeViewModel::Hidden).toBool());
+                }
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel notifies the roles that changed")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        QList<int> changedRows;
+        QList<QVector<int>> changedRoles;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::dataChanged,
+                         [&](const QModelIndex& topLeft, const QModelIndex&, const QVector<int>& roles) {
+                             changedRows.append(topLeft.row());
+                             changedRoles.append(roles);
+                         });
+
+        WHEN("the tooltip of an item changes in the source model") {
+            allItems[4]->setData("Tooltip", Qt::ToolTipRole);
+
+            THEN("the change is forwarded with the roles of the source model") {
+                REQUIRE(changedRows == QList<int>({4}));
+                REQUIRE(changedRoles[0] == QVector<int>{Qt::ToolTipRole});
+            }
+        }
+
+        WHEN("the data of sibling items separated by their descendants changes in the source model") {
+            QModelIndex rootIndex = standardItemModel->index(0, 0);
+            emit standardItemModel->dataChanged(standardItemModel->index(0, 0, rootIndex),
+                                                standardItemModel->index(2, 0, rootIndex), QVector<int>{Qt::DisplayRole});
+
+            THEN("each contiguous span of rows is notified separately") {
+                REQUIRE(changedRows == QList<int>({1, 4, 6}));
+                REQUIRE(changedRoles[0] == QVector<int>{Qt::DisplayRole});
+            }
+        }
+
+        WHEN("a first child is inserted in an item") {
+            allItems[6]->appendRow(new QStandardItem("Child 1 of Child 3"));
+
+            THEN("the hasChildren role of the item changes") {
+                REQUIRE(changedRows == QList<int>({6}));
+                REQUIRE(changedRoles[0] == QVector<int>{TreeViewModel::HasChildren});
+            }
+        }
+
+        WHEN("the last child of an item is removed") {
+            allItems[4]->removeRow(0);
+
+            THEN("the hasChildren role of the item changes") {
+                REQUIRE(changedRows == QList<int>({4}));
+                REQUIRE(changedRoles[0] == QVector<int>{TreeViewModel::HasChildren});
+                REQUIRE(!treeViewModel.data(treeViewModel.index(4), TreeViewModel::HasChildren).toBool());
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel resolves the proxy chain of its source model")
+{
+    GIVEN("A TreeViewModel on top of two proxy models") {
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        MapCountingProxyModel bottomProxyModel;
+        bottomProxyModel.setSourceModel(standardItemModel.get());
+        QIdentityProxyModel topProxyModel;
+        topProxyModel.setSourceModel(&bottomProxyModel);
+        TreeViewModel treeViewModel;
+        treeViewModel.setSourceModel(&topProxyModel);
+
+        THEN("the expanded state of the items is mapped through both proxy models") {
+            REQUIRE(bottomProxyModel.mappedIndexes > 0);
+        }
+
+        WHEN("the top proxy model is moved on top of the source model") {
+            topProxyModel.setSourceModel(standardItemModel.get());
+            bottomProxyModel.mappedIndexes = 0;
+            allItems[6]->appendRow(new QStandardItem("Child 1 of Child 3"));
+
+            THEN("the items are no longer mapped through the bottom proxy model") {
+                REQUIRE(treeViewModel.rowCount() == 8);
+                REQUIRE(bottomProxyModel.mappedIndexes == 0);
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel keeps the expanded state of the items when the source rows change")
+{
+    GIVEN("A TreeViewModel whose item Child 2 is expanded") {
+        TreeViewModel treeViewModel;
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        treeViewModel.setData(treeViewModel.index(4), true, TreeViewModel::IsExpanded);
+
+        WHEN("an item is inserted before it and the model is rebuilt") {
+            allItems[0]->insertRow(0, new QStandardItem("Child 0"));
+            treeViewModel.setSourceModel(standardItemModel.get());
+
+            THEN("only the item Child 2 is expanded") {
+                REQUIRE(treeViewModel.data(treeViewModel.index(2), Qt::DisplayRole).toString() == "Child 1");
+                REQUIRE(!treeViewModel.data(treeViewModel.index(2), TreeViewModel::IsExpanded).toBool());
+                REQUIRE(treeViewModel.data(treeViewModel.index(5), Qt::DisplayRole).toString() == "Child 2");
+                REQUIRE(treeViewModel.data(treeViewModel.index(5), TreeViewModel::IsExpanded).toBool());
+            }
+        }
+
+        WHEN("an item is inserted before it, it is collapsed and the model is rebuilt") {
+            allItems[0]->insertRow(0, new QStandardItem("Child 0"));
+            treeViewModel.setData(treeViewModel.index(5), false, TreeViewModel::IsExpanded);
+            treeViewModel.setSourceModel(standardItemModel.get());
+
+            THEN("the item Child 2 is collapsed") {
+                REQUIRE(treeViewModel.data(treeViewModel.index(5), Qt::DisplayRole).toString() == "Child 2");
+                REQUIRE(!treeViewModel.data(treeViewModel.index(5), TreeViewModel::IsExpanded).toBool());
+            }
+        }
+
+        WHEN("it is removed and another item is inserted in its place") {
+            allItems[0]->removeRow(1);
+            allItems[0]->insertRow(1, new QStandardItem("New child 2"));
+            treeViewModel.setSourceModel(standardItemModel.get());
+
+            THEN("the new item is collapsed") {
+                REQUIRE(treeViewModel.data(treeViewModel.index(4), Qt::DisplayRole).toString() == "New child 2");
+                REQUIRE(!treeViewModel.data(treeViewModel.index(4), TreeViewModel::IsExpanded).toBool());
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel saves and restores the expanded state of the items")
+{
+    GIVEN("A TreeViewModel in visible rows only mode with the items Root and Child 1 expanded") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        MovableTreeModel sourceModel;
+        makeBasicMovableTreeModel(&sourceModel);
+        treeViewModel.setSourceModel(&sourceModel);
+        treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+        treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+
+        WHEN("the source model is reset") {
+            sourceModel.reset([&](MovableTreeModel::Item* root) {
+                sourceModel.appendItem(root->children[0], "Child 4");
+            });
+
+            THEN("the expanded items are still expanded") {
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                "Child 2 of Child 1", "Child 2", "Child 3", "Child 4"}));
+                REQUIRE(treeViewModel.data(treeViewModel.index(1), TreeViewModel::IsExpanded).toBool());
+            }
+        }
+
+        WHEN("the item Root is collapsed and the state is restored in another TreeViewModel") {
+            treeViewModel.setData(treeViewModel.index(0), false, TreeViewModel::IsExpanded);
+            QByteArray state = treeViewModel.saveExpandedState();
+            TreeViewModel otherTreeViewModel;
+            otherTreeViewModel.setVisibleRowsOnly(true);
+            otherTreeViewModel.setSourceModel(&sourceModel);
+            bool restored = otherTreeViewModel.restoreExpandedState(state);
+
+            THEN("the state holds the key of the expanded item") {
+                REQUIRE(state == QByteArray("[\"/Root/Child 1\"]"));
+            }
+
+            THEN("the item Child 1 is expanded under the collapsed item Root") {
+                REQUIRE(restored);
+                REQUIRE(rowTexts(otherTreeViewModel) == QStringList({"Root"}));
+                otherTreeViewModel.setData(otherTreeViewModel.index(0), true, TreeViewModel::IsExpanded);
+                REQUIRE(rowTexts(otherTreeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                     "Child 2 of Child 1", "Child 2", "Child 3"}));
+                REQUIRE(otherTreeViewModel.data(otherTreeViewModel.index(1), TreeViewModel::IsExpanded).toBool());
+            }
+        }
+
+        WHEN("a state that is not a JSON array is restored") {
+            bool restored = treeViewModel.restoreExpandedState("{\"/Root\": true}");
+
+            THEN("the expanded items are unchanged") {
+                REQUIRE(!restored);
+                REQUIRE(treeViewModel.rowCount() == 6);
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel in visible rows only mode on items whose texts contain the key separators") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        MovableTreeModel sourceModel;
+        MovableTreeModel::Item* slashItem = sourceModel.appendItem(sourceModel.root(), "a/b");
+        sourceModel.appendItem(sourceModel.appendItem(slashItem, "c"), "d");
+        MovableTreeModel::Item* aItem = sourceModel.appendItem(sourceModel.root(), "a");
+        sourceModel.appendItem(sourceModel.appendItem(aItem, "b"), "e");
+        treeViewModel.setSourceModel(&sourceModel);
+        treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+        treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+
+        WHEN("the item a/b is collapsed and the state is restored in another TreeViewModel") {
+            treeViewModel.setData(treeViewModel.index(0), false, TreeViewModel::IsExpanded);
+            QByteArray state = treeViewModel.saveExpandedState();
+            TreeViewModel otherTreeViewModel;
+            otherTreeViewModel.setVisibleRowsOnly(true);
+            otherTreeViewModel.setSourceModel(&sourceModel);
+            REQUIRE(otherTreeViewModel.restoreExpandedState(state));
+
+            THEN("only the item c is expanded") {
+                REQUIRE(rowTexts(otherTreeViewModel) == QStringList({"a/b", "a"}));
+                otherTreeViewModel.setData(otherTreeViewModel.index(0), true, TreeViewModel::IsExpanded);
+                otherTreeViewModel.setData(otherTreeViewModel.index(3), true, TreeViewModel::IsExpanded);
+                REQUIRE(rowTexts(otherTreeViewModel) == QStringList({"a/b", "c", "d", "a", "b"}));
+                REQUIRE(otherTreeViewModel.data(otherTreeViewModel.index(1), TreeViewModel::IsExpanded).toBool());
+                REQUIRE(!otherTreeViewModel.data(otherTreeViewModel.index(4), TreeViewModel::IsExpanded).toBool());
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel whose items are identified by an id role") {
+        const int idRole = Qt::UserRole + 1;
+        TreeViewModel treeViewModel;
+        treeViewModel.setKeyRole(idRole);
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        for (int i = 0; i < allItems.count(); ++i)
+            allItems[i]->setData(QString("id%1").arg(i), idRole);
+        treeViewModel.setSourceModel(standardItemModel.get());
+        treeViewModel.setData(treeViewModel.index(1), true, TreeViewModel::IsExpanded);
+
+        WHEN("the expanded state is saved") {
+            QByteArray state = treeViewModel.saveExpandedState();
+
+            THEN("the state holds the path of the ids of the expanded item") {
+                REQUIRE(state == QByteArray("[\"/id0/id1\"]"));
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel expands and collapses items in bulk")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        QList<QPair<int, int>> changedRanges;
+        QList<QVector<int>> changedRoles;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::dataChanged,
+                         [&](const QModelIndex& topLeft, const QModelIndex& bottomRight, const QVector<int>& roles) {
+                             changedRanges.append(qMakePair(topLeft.row(), bottomRight.row()));
+                             changedRoles.append(roles);
+                         });
+        auto expandedRows = [&]() {
+            QList<int> rows;
+            for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                if (treeViewModel.data(treeViewModel.index(row), TreeViewModel::IsExpanded).toBool())
+                    rows.append(row);
+            }
+            return rows;
+        };
+        auto hiddenRows = [&]() {
+            QList<int> rows;
+            for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                if (treeViewModel.data(treeViewModel.index(row), TreeViewModel::Hidden).toBool())
+                    rows.append(row);
+            }
+            return rows;
+        };
+
+        WHEN("all the items are expanded") {
+            treeViewModel.expandAll();
+
+            THEN("the items that have children are expanded and the change is notified at once") {
+                REQUIRE(expandedRows() == QList<int>({0, 1, 4}));
+                REQUIRE(hiddenRows().isEmpty());
+                REQUIRE(changedRanges == QList<QPair<int, int>>({qMakePair(0, 6)}));
+                REQUIRE(changedRoles[0] == QVector<int>({TreeViewModel::IsExpanded, TreeViewModel::Hidden}));
+            }
+
+            AND_WHEN("all the items are collapsed") {
+                treeViewModel.collapseAll();
+
+                THEN("only the top level item is visible") {
+                    REQUIRE(expandedRows().isEmpty());
+                    REQUIRE(hiddenRows() == QList<int>({1, 2, 3, 4, 5, 6}));
+                }
+            }
+        }
+
+        WHEN("the items are expanded to depth 0") {
+            treeViewModel.expandToDepth(0);
+
+            THEN("only the top level item is expanded") {
+                REQUIRE(expandedRows() == QList<int>({0}));
+                REQUIRE(hiddenRows() == QList<int>({2, 3, 5}));
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel in visible rows only mode") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        int resets = 0;
+        QList<QPair<int, int>> insertedRanges;
+        QList<QPair<int, int>> removedRanges;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::modelReset, [&]() { ++resets; });
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsInserted,
+                         [&](const QModelIndex&, int first, int last) { insertedRanges.append(qMakePair(first, last)); });
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsRemoved,
+                         [&](const QModelIndex&, int first, int last) { removedRanges.append(qMakePair(first, last)); });
+
+        WHEN("all the items are expanded") {
+            treeViewModel.expandAll();
+
+            THEN("the model is reset once with all the rows") {
+                REQUIRE(resets == 1);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                "Child 2 of Child 1", "Child 2", "Child 1 of Child 2",
+                                                                "Child 3"}));
+            }
+
+            AND_WHEN("the items are expanded to depth 0") {
+                treeViewModel.expandToDepth(0);
+
+                THEN("the top level item and its children are rows") {
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 2", "Child 3"}));
+                }
+            }
+        }
+
+        WHEN("the collapsed top level item is expanded recursively") {
+            treeViewModel.expandRecursively(0);
+
+            THEN("the rows of its descendants are inserted at once") {
+                REQUIRE(resets == 0);
+                REQUIRE(removedRanges.isEmpty());
+                REQUIRE(insertedRanges == QList<QPair<int, int>>({qMakePair(1, 6)}));
+                REQUIRE(treeViewModel.rowCount() == 7);
+            }
+        }
+
+        WHEN("the expanded top level item is expanded recursively") {
+            treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+            insertedRanges.clear();
+            treeViewModel.expandRecursively(0);
+
+            THEN("the rows of its descendants are replaced as a block") {
+                REQUIRE(removedRanges == QList<QPair<int, int>>({qMakePair(1, 3)}));
+                REQUIRE(insertedRanges == QList<QPair<int, int>>({qMakePair(1, 6)}));
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                "Child 2 of Child 1", "Child 2", "Child 1 of Child 2",
+                                                                "Child 3"}));
+                REQUIRE(treeViewModel.data(treeViewModel.index(1), TreeViewModel::Indentation).toInt() == 1);
+                QModelIndex child1OfChild2 = standardItemModel->index(0, 0, standardItemModel->index(1, 0,
+                                                                      standardItemModel->index(0, 0)));
+                REQUIRE(treeViewModel.mapFromSource(child1OfChild2).row() == 5);
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel only flattens the subtree of its root index")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<RowCountRecordingModel> standardItemModel = make_unique<RowCountRecordingModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        int resets = 0;
+        QList<QPair<int, int>> insertedRanges;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::modelReset, [&]() { ++resets; });
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsInserted,
+                         [&](const QModelIndex&, int first, int last) { insertedRanges.append(qMakePair(first, last)); });
+
+        WHEN("the root index is set to the item Child 1") {
+            standardItemModel->countedParents.clear();
+            treeViewModel.setRootIndex(allItems[1]->index());
+
+            THEN("only its children are rows, with the items that were already created") {
+                REQUIRE(resets == 1);
+                REQUIRE(treeViewModel.rootIndex() == allItems[1]->index());
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Child 1 of Child 1", "Child 2 of Child 1"}));
+                REQUIRE(treeViewModel.data(treeViewModel.index(0), TreeViewModel::Indentation).toInt() == 0);
+                REQUIRE(!treeViewModel.data(treeViewModel.index(0), TreeViewModel::Hidden).toBool());
+                REQUIRE(treeViewModel.mapFromSource(allItems[3]->index()).row() == 1);
+                REQUIRE(!treeViewModel.mapFromSource(allItems[1]->index()).isValid());
+                REQUIRE(standardItemModel->countedParents.isEmpty());
+            }
+
+            AND_WHEN("rows are inserted outside of its subtree and in its subtree") {
+                allItems[4]->appendRow(new QStandardItem("Child 2 of Child 2"));
+                allItems[1]->appendRow(new QStandardItem("Child 3 of Child 1"));
+
+                THEN("only the rows of its subtree are inserted") {
+                    REQUIRE(insertedRanges == QList<QPair<int, int>>({qMakePair(2, 2)}));
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Child 1 of Child 1", "Child 2 of Child 1",
+                                                                    "Child 3 of Child 1"}));
+                }
+            }
+
+            AND_WHEN("a row is inserted before it") {
+                allItems[0]->insertRow(0, new QStandardItem("Child 0"));
+                allItems[1]->appendRow(new QStandardItem("Child 3 of Child 1"));
+
+                THEN("its subtree is still tracked") {
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Child 1 of Child 1", "Child 2 of Child 1",
+                                                                    "Child 3 of Child 1"}));
+                }
+            }
+
+            AND_WHEN("the root index is set back to the top of the tree") {
+                standardItemModel->countedParents.clear();
+                treeViewModel.setRootIndex(QModelIndex());
+
+                THEN("the whole tree is flattened again, reusing the items of Child 1") {
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                    "Child 2 of Child 1", "Child 2",
+                                                                    "Child 1 of Child 2", "Child 3"}));
+                    REQUIRE(treeViewModel.data(treeViewModel.index(1), TreeViewModel::Indentation).toInt() == 1);
+                    REQUIRE(treeViewModel.data(treeViewModel.index(2), TreeViewModel::Indentation).toInt() == 2);
+                    REQUIRE(treeViewModel.mapFromSource(allItems[3]->index()).row() == 3);
+                    REQUIRE(treeViewModel.mapFromSource(allItems[5]->index()).row() == 5);
+                    REQUIRE(!standardItemModel->countedParents.contains("Child 1"));
+                }
+            }
+
+            AND_WHEN("the item Child 1 is removed from the source model") {
+                allItems[0]->removeRow(0);
+
+                THEN("the root index goes back to the top of the tree") {
+                    REQUIRE(resets == 2);
+                    REQUIRE(!treeViewModel.rootIndex().isValid());
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 2", "Child 1 of Child 2",
+                                                                    "Child 3"}));
+                }
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel in visible rows only mode") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        unique_ptr<QStandardItemModel> standardItemModel = make_unique<QStandardItemModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+
+        WHEN("the root index is set to the collapsed item Root, then to the item Child 1 and back to the top") {
+            treeViewModel.setRootIndex(allItems[0]->index());
+            QStringList rootRows = rowTexts(treeViewModel);
+            treeViewModel.setRootIndex(allItems[1]->index());
+            QStringList child1Rows = rowTexts(treeViewModel);
+            treeViewModel.setRootIndex(QModelIndex());
+
+            THEN("the rows are the visible descendants of each root") {
+                REQUIRE(rootRows == QStringList({"Child 1", "Child 2", "Child 3"}));
+                REQUIRE(child1Rows == QStringList({"Child 1 of Child 1", "Child 2 of Child 1"}));
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                "Child 2 of Child 1", "Child 2", "Child 3"}));
+                REQUIRE(treeViewModel.data(treeViewModel.index(0), TreeViewModel::IsExpanded).toBool());
+                REQUIRE(treeViewModel.mapFromSource(allItems[4]->index()).row() == 4);
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel builds the rows of a reset in time slices")
+{
+    GIVEN("A TreeViewModel with a loading time budget and a source model that is slow to traverse") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setLoadingTimeBudget(1);
+        unique_ptr<SlowRowCountModel> standardItemModel = make_unique<SlowRowCountModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        int resets = 0;
+        int loadingChanges = 0;
+        QList<QPair<int, int>> insertedRanges;
+        QList<int> rowCounts;
+        QList<qreal> progresses;
+        QObject::connect(&treeViewModel, &QAbstractItemModel::modelReset, [&]() { ++resets; });
+        QObject::connect(&treeViewModel, &TreeViewModel::loadingChanged, [&]() { ++loadingChanges; });
+        QObject::connect(&treeViewModel, &TreeViewModel::loadingProgressChanged,
+                         [&]() { progresses.append(treeViewModel.loadingProgress()); });
+        QObject::connect(&treeViewModel, &QAbstractItemModel::rowsAboutToBeInserted,
+                         [&](const QModelIndex&, int first, int last) {
+                             insertedRanges.append(qMakePair(first, last));
+                             rowCounts.append(treeViewModel.rowCount());
+                         });
+        treeViewModel.setSourceModel(standardItemModel.get());
+        QStringList firstRows = rowTexts(treeViewModel);
+        bool wasLoading = treeViewModel.isLoading();
+
+        WHEN("the event loop runs until the rows are built") {
+            for (int i = 0; i < 100 && treeViewModel.isLoading(); ++i)
+                QCoreApplication::processEvents();
+
+            THEN("the rows are appended slice by slice after the first one") {
+                REQUIRE(resets == 1);
+                REQUIRE(wasLoading);
+                REQUIRE(firstRows.count() < 7);
+                REQUIRE(!treeViewModel.isLoading());
+                REQUIRE(loadingChanges == 2);
+                REQUIRE(insertedRanges.count() > 1);
+                for (int i = 0; i < insertedRanges.count(); ++i)
+                    REQUIRE(insertedRanges[i].first == rowCounts[i]);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                "Child 2 of Child 1", "Child 2", "Child 1 of Child 2",
+                                                                "Child 3"}));
+                REQUIRE(treeViewModel.mapFromSource(allItems[5]->index()).row() == 5);
+                REQUIRE(std::is_sorted(progresses.begin(), progresses.end()));
+                REQUIRE(progresses.last() == 1);
+            }
+        }
+
+        WHEN("a row is inserted under an item whose children are being built") {
+            allItems[0]->appendRow(new QStandardItem("Child 4"));
+
+            THEN("the remaining rows are built first") {
+                REQUIRE(!treeViewModel.isLoading());
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Root", "Child 1", "Child 1 of Child 1",
+                                                                "Child 2 of Child 1", "Child 2", "Child 1 of Child 2",
+                                                                "Child 3", "Child 4"}));
+            }
+        }
+
+        WHEN("the layout of the source model changes while the rows are being built") {
+            bool layoutChanging = false;
+            int rowsInsertedDuringLayoutChange = 0;
+            QObject::connect(&treeViewModel, &QAbstractItemModel::layoutAboutToBeChanged,
+                             [&]() { layoutChanging = true; });
+            QObject::connect(&treeViewModel, &QAbstractItemModel::layoutChanged, [&]() { layoutChanging = false; });
+            QObject::connect(&treeViewModel, &QAbstractItemModel::rowsInserted,
+                             [&]() { rowsInsertedDuringLayoutChange += layoutChanging; });
+            emit standardItemModel->layoutAboutToBeChanged();
+            emit standardItemModel->layoutChanged();
+
+            THEN("the remaining rows are inserted before the layout change is announced") {
+                REQUIRE(!treeViewModel.isLoading());
+                REQUIRE(rowsInsertedDuringLayoutChange == 0);
+                REQUIRE(treeViewModel.rowCount() == 7);
+            }
+        }
+
+        WHEN("the items are expanded in bulk while the rows are being built") {
+            treeViewModel.collapseAll();
+            treeViewModel.expandAll();
+
+            THEN("all the items are expanded") {
+                REQUIRE(!treeViewModel.isLoading());
+                REQUIRE(treeViewModel.data(treeViewModel.index(4), TreeViewModel::IsExpanded).toBool());
+                REQUIRE(!treeViewModel.data(treeViewModel.index(5), TreeViewModel::Hidden).toBool());
+            }
+        }
+
+        WHEN("the source model is reset while the rows are being built") {
+            standardItemModel->clear();
+
+            THEN("the loading is abandoned") {
+                REQUIRE(resets == 2);
+                REQUIRE(treeViewModel.rowCount() == 0);
+                REQUIRE(!treeViewModel.isLoading());
+                REQUIRE(loadingChanges == 2);
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel caches whether the source items have children")
+{
+    GIVEN("A TreeViewModel with a root node and some child nodes") {
+        TreeViewModel treeViewModel;
+        unique_ptr<HasChildrenCountingModel> standardItemModel = make_unique<HasChildrenCountingModel>();
+        QList<QStandardItem*> allItems = makeBasicStandardItemModel(standardItemModel.get());
+        treeViewModel.setSourceModel(standardItemModel.get());
+        auto hasChildrenRows = [&]() {
+            QList<int> rows;
+            for (int row = 0; row < treeViewModel.rowCount(); ++row) {
+                if (treeViewModel.data(treeViewModel.index(row), TreeViewModel::HasChildren).toBool())
+                    rows.append(row);
+            }
+            return rows;
+        };
+
+        WHEN("the hasChildren role of every row is read twice") {
+            standardItemModel->hasChildrenCalls = 0;
+            QList<int> firstRows = hasChildrenRows();
+            QList<int> secondRows = hasChildrenRows();
+
+            THEN("the source model is only asked about the leaves, once") {
+                REQUIRE(firstRows == QList<int>({0, 1, 4}));
+                REQUIRE(secondRows == firstRows);
+                REQUIRE(standardItemModel->hasChildrenCalls == 4);
+            }
+        }
+
+        WHEN("a child is appended to a leaf and the children of an item are removed") {
+            hasChildrenRows();
+            allItems[6]->appendRow(new QStandardItem("Child 1 of Child 3"));
+            allItems[4]->removeRow(0);
+
+            THEN("the hasChildren role follows the source model") {
+                REQUIRE(hasChildrenRows() == QList<int>({0, 1, 5}));
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel throttles and prioritizes the fetches of a lazy source model")
+{
+    GIVEN("A TreeViewModel that allows two fetches in flight and shows the last rows of a lazy source model") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setMaxFetchesInFlight(2);
+        unique_ptr<LazyFetchModel> lazyModel = make_unique<LazyFetchModel>();
+        for (int i = 0; i < 10; ++i) {
+            lazyModel->appendRow(new QStandardItem(QString("Dir %1").arg(i)));
+            lazyModel->lazyItems.append(QString("Dir %1").arg(i));
+        }
+        treeViewModel.setSourceModel(lazyModel.get());
+        treeViewModel.setVisibleRange(8, 9);
+
+        WHEN("all the items are expanded") {
+            treeViewModel.expandAll();
+
+            THEN("only the fetches of the visible items are started") {
+                REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 8", "Dir 9"}));
+            }
+
+            AND_WHEN("the children of an item are loaded") {
+                lazyModel->item(9)->appendRow(new QStandardItem("File"));
+                QCoreApplication::processEvents();
+
+                THEN("the fetch of the item closest to the visible range is started") {
+                    REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 8", "Dir 9", "Dir 7"}));
+                }
+            }
+
+            AND_WHEN("the items are collapsed before their children are loaded") {
+                treeViewModel.collapseAll();
+                lazyModel->item(8)->appendRow(new QStandardItem("File"));
+                lazyModel->item(9)->appendRow(new QStandardItem("File"));
+                QCoreApplication::processEvents();
+
+                THEN("their fetches are dropped") {
+                    REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 8", "Dir 9"}));
+                }
+            }
+        }
+
+        WHEN("an item is expanded while the fetch of another one is in flight") {
+            treeViewModel.setData(treeViewModel.index(8), true, TreeViewModel::IsExpanded);
+            treeViewModel.restoreExpandedState("[\"/Dir 8\", \"/Dir 9\"]");
+            QCoreApplication::processEvents();
+
+            THEN("its fetch is started right away, without waiting for the expiry of the other one") {
+                REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 8", "Dir 9"}));
+            }
+        }
+
+        WHEN("the fetches take longer than the fetch timeout to insert their first rows") {
+            treeViewModel.setMaxFetchesInFlight(1);
+            treeViewModel.setFetchTimeout(20);
+            treeViewModel.expandAll();
+            QElapsedTimer timer;
+            timer.start();
+            // well under the default timeout
+            while (lazyModel->fetchedItems.count() < 2 && timer.elapsed() < 500)
+                QCoreApplication::processEvents();
+
+            THEN("the next fetch is started once the timeout expires") {
+                REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 8", "Dir 9"}));
+            }
+        }
+    }
+
+    GIVEN("A TreeViewModel that builds the rows of a lazy source model in time slices, with an expanded lazy item") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setLoadingTimeBudget(1);
+        unique_ptr<SlowLazyFetchModel> lazyModel = make_unique<SlowLazyFetchModel>();
+        QStandardItem* root = new QStandardItem("Root");
+        lazyModel->appendRow(root);
+        for (int i = 0; i < 3; ++i)
+            root->appendRow(new QStandardItem(QString("Dir %1").arg(i)));
+        lazyModel->lazyItems.append("Dir 2");
+        treeViewModel.setSourceModel(lazyModel.get());
+        treeViewModel.restoreExpandedState("[\"/Root\", \"/Root/Dir 2\"]");
+        REQUIRE(treeViewModel.isLoading());
+
+        WHEN("a row is inserted under an item whose children are being built") {
+            root->appendRow(new QStandardItem("Dir 3"));
+
+            THEN("the fetch of the expanded item is not started from the signal of the source model") {
+                REQUIRE(!treeViewModel.isLoading());
+                REQUIRE(lazyModel->fetchedItems.isEmpty());
+                QCoreApplication::processEvents();
+                REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 2"}));
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel prefetches the children of the visible collapsed items")
+{
+    GIVEN("A TreeViewModel that prefetches one level and shows the first rows of a lazy source model") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setPrefetchDepth(1);
+        unique_ptr<LazyFetchModel> lazyModel = make_unique<LazyFetchModel>();
+        for (int i = 0; i < 10; ++i) {
+            lazyModel->appendRow(new QStandardItem(QString("Dir %1").arg(i)));
+            lazyModel->lazyItems.append(QString("Dir %1").arg(i));
+        }
+        treeViewModel.setSourceModel(lazyModel.get());
+        auto waitForFetches = [&](int count, int timeout) {
+            QElapsedTimer timer;
+            timer.start();
+            while (lazyModel->fetchedItems.count() < count && timer.elapsed() < timeout)
+                QCoreApplication::processEvents();
+        };
+
+        WHEN("the visible range is reported") {
+            treeViewModel.setVisibleRange(0, 2);
+            bool fetchedRightAway = !lazyModel->fetchedItems.isEmpty();
+            waitForFetches(3, 2000);
+
+            THEN("the visible items are prefetched once the view is idle") {
+                REQUIRE(!fetchedRightAway);
+                REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 0", "Dir 1", "Dir 2"}));
+            }
+
+            AND_WHEN("a prefetched item is expanded") {
+                lazyModel->item(0)->appendRow(new QStandardItem("File"));
+                treeViewModel.setData(treeViewModel.index(0), true, TreeViewModel::IsExpanded);
+
+                THEN("its children are rows right away") {
+                    REQUIRE(rowTexts(treeViewModel).mid(0, 2) == QStringList({"Dir 0", "File"}));
+                    REQUIRE(lazyModel->fetchedItems.count() == 3);
+                }
+            }
+        }
+
+        WHEN("the prefetched items have loaded more rows than the budget") {
+            treeViewModel.setPrefetchBudget(2);
+            treeViewModel.setVisibleRange(0, 0);
+            waitForFetches(1, 2000);
+            lazyModel->item(0)->appendRow(new QStandardItem("File 1"));
+            lazyModel->item(0)->appendRow(new QStandardItem("File 2"));
+            treeViewModel.setVisibleRange(1, 2);
+            // the prefetch would start after prefetchDelay
+            waitForFetches(2, 500);
+
+            THEN("nothing more is prefetched") {
+                REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 0"}));
+            }
+        }
+
+        WHEN("two levels are prefetched and a row is inserted before a prefetched item") {
+            treeViewModel.setPrefetchDepth(2);
+            lazyModel->lazyItems.append("Sub");
+            treeViewModel.setVisibleRange(0, 1);
+            waitForFetches(2, 2000);
+            lazyModel->insertRow(0, new QStandardItem("New"));
+            lazyModel->item(1)->appendRow(new QStandardItem("Sub"));
+            waitForFetches(3, 2000);
+
+            THEN("the next level is prefetched once the children of the item are loaded") {
+                REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 0", "Dir 1", "Sub"}));
+            }
+        }
+
+        WHEN("the items that are prefetched at once load more rows than the budget") {
+            lazyModel->rowsPerFetch = 3;
+            treeViewModel.setPrefetchBudget(5);
+            treeViewModel.setVisibleRange(0, 3);
+            waitForFetches(4, 500);
+
+            THEN("the prefetch stops once the budget is reached") {
+                REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 0", "Dir 1"}));
+            }
+        }
+    }
+}
+
+
+SCENARIO("TreeViewModel reveals an item of a lazy source model asynchronously")
+{
+    GIVEN("A TreeViewModel in visible rows only mode and a lazy source model") {
+        TreeViewModel treeViewModel;
+        treeViewModel.setVisibleRowsOnly(true);
+        unique_ptr<LazyFetchModel> lazyModel = make_unique<LazyFetchModel>();
+        for (int i = 0; i < 3; ++i) {
+            lazyModel->appendRow(new QStandardItem(QString("Dir %1").arg(i)));
+            lazyModel->lazyItems.append(QString("Dir %1").arg(i));
+        }
+        lazyModel->lazyItems.append("Sub");
+        treeViewModel.setSourceModel(lazyModel.get());
+
+        WHEN("the path of an item is revealed") {
+            QFuture<int> future = treeViewModel.revealPath({"Dir 1", "Sub", "File"});
+
+            THEN("the children of the first ancestor are fetched") {
+                REQUIRE(!future.isFinished());
+                REQUIRE(lazyModel->fetchedItems == QStringList({"Dir 1"}));
+            }
+
+            AND_WHEN("the ancestors are loaded level by level") {
+                lazyModel->item(1)->appendRow(new QStandardItem("Sub"));
+                QCoreApplication::processEvents();
+                QStringList fetchedItems = lazyModel->fetchedItems;
+                lazyModel->item(1)->child(0)->appendRow(new QStandardItem("File"));
+                QCoreApplication::processEvents();
+
+                THEN("the future resolves with the row of the item, whose ancestors are expanded") {
+                    REQUIRE(fetchedItems == QStringList({"Dir 1", "Sub"}));
+                    REQUIRE(future.isFinished());
+                    REQUIRE(future.result() == 3);
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Dir 0", "Dir 1", "Sub", "File", "Dir 2"}));
+                }
+            }
+
+            AND_WHEN("an ancestor is collapsed before the next level is loaded") {
+                lazyModel->item(1)->appendRow(new QStandardItem("Sub"));
+                QCoreApplication::processEvents();
+                treeViewModel.setData(treeViewModel.index(1), false, TreeViewModel::IsExpanded);
+                lazyModel->item(1)->child(0)->appendRow(new QStandardItem("File"));
+                QCoreApplication::processEvents();
+
+                THEN("the ancestor is expanded again and the future resolves with the row of the item") {
+                    REQUIRE(future.isFinished());
+                    REQUIRE(future.result() == 3);
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Dir 0", "Dir 1", "Sub", "File", "Dir 2"}));
+                }
+            }
+
+            AND_WHEN("the future is canceled") {
+                future.cancel();
+                lazyModel->item(1)->appendRow(new QStandardItem("Sub"));
+                QCoreApplication::processEvents();
+
+                THEN("it finishes without a result") {
+                    REQUIRE(future.isFinished());
+                    REQUIRE(future.resultCount() == 0);
+                }
+            }
+
+            AND_WHEN("the children of an ancestor are loaded in several batches") {
+                lazyModel->item(1)->appendRow(new QStandardItem("Other"));
+                QCoreApplication::processEvents();
+                bool finishedAfterFirstBatch = future.isFinished();
+                lazyModel->item(1)->appendRow(new QStandardItem("Sub"));
+                QCoreApplication::processEvents();
+                lazyModel->item(1)->child(1)->appendRow(new QStandardItem("File"));
+                QCoreApplication::processEvents();
+
+                THEN("the future waits for the batch that contains the next item of the path") {
+                    REQUIRE(!finishedAfterFirstBatch);
+                    REQUIRE(future.isFinished());
+                    REQUIRE(future.result() == 4);
+                    REQUIRE(rowTexts(treeViewModel) == QStringList({"Dir 0", "Dir 1", "Other", "Sub", "File",
+                                                                    "Dir 2"}));
+                }
+            }
+        }
+
+        WHEN("the path of an item is expanded") {
+            QFuture<int> future = treeViewModel.expandPath({"Dir 2"});
+            bool finishedBeforeLoad = future.isFinished();
+            lazyModel->item(2)->appendRow(new QStandardItem("File"));
+            QCoreApplication::processEvents();
+
+            THEN("the future resolves once the children of the item are loaded") {
+                REQUIRE(!finishedBeforeLoad);
+                REQUIRE(future.result() == 2);
+                REQUIRE(rowTexts(treeViewModel) == QStringList({"Dir 0", "Dir 1", "Dir 2", "File"}));
+            }
+        }
+
+        WHEN("the children of an ancestor are not loaded in time") {
+            QFuture<int> future = treeViewModel.revealPath({"Dir 0", "File"}, 50);
+            QElapsedTimer timer;
+            timer.start();
+            while (!future.isFinished() && timer.elapsed() < 2000)
+                QCoreApplication::processEvents();
+
+            THEN("the future resolves with -1") {
+                REQUIRE(future.isFinished());
+                REQUIRE(future.result() == -1);
+            }
+        }
+
+        WHEN("the children of an ancestor do not contain the next item of the path") {
+            QElapsedTimer timer;
+            timer.start();
+            QFuture<int> future = treeViewModel.revealPath({"Dir 0", "File"}, 50);
+            lazyModel->item(0)->appendRow(new QStandardItem("Other"));
+            QCoreApplication::processEvents();
+            bool finishedAfterLoad = future.isFinished();
+            while (!future.isFinished() && timer.elapsed() < 2000)
+                QCoreApplication::processEvents();
+
+            THEN("the future resolves with -1 at the deadline of the request") {
+                REQUIRE(!finishedAfterLoad);
+                REQUIRE(future.isFinished());
+                REQUIRE(future.result() == -1);
+                REQUIRE(timer.elapsed() >= 45);
+            }
+        }
+    }
+}
@@ -1,2 +1,10 @@
-#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_RUNNER
 #include "catch.hpp"
+#include <QtCore/QCoreApplication>
+
+int main(int argc, char* argv[])
+{
+    // the timers of the models (e.g. TreeViewModel::setLoadingTimeBudget) need an event loop
+    QCoreApplication application(argc, argv);
+    return Catch::Session().run(argc, argv);
+}